@@ -21,6 +21,7 @@
 #import <GTWSWBase/GTWQuad.h>
 #import <SPARQLKit/SPKNTriplesSerializer.h>
 #import "GTWAOFQuadStore.h"
+#import "GTWAOFMemory.h"
 #import "GTWAOFRawValue.h"
 #import "GTWAOFBTreeNode.h"
 #import "GTWAOFBTree.h"
@@ -320,4 +321,326 @@ static NSData* dataFromIntegers(NSUInteger a, NSUInteger b, NSUInteger c, NSUInt
     }
 }
 
+
+- (void)test_quadStoreIdentifierRanges {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    XCTAssertNotNil(store, @"Quad store created");
+    GTWIRI* s   = [[GTWIRI alloc] initWithValue:@"http://example.org/s"];
+    GTWIRI* p   = [[GTWIRI alloc] initWithValue:@"http://example.org/value"];
+    GTWIRI* g   = [[GTWIRI alloc] initWithValue:@"http://example.org/graph"];
+    NSString* integer   = @"http://www.w3.org/2001/XMLSchema#integer";
+    NSString* decimal   = @"http://www.w3.org/2001/XMLSchema#decimal";
+    NSArray* objects    = @[
+                            [[GTWLiteral alloc] initWithValue:@"3" datatype:integer],
+                            [[GTWLiteral alloc] initWithValue:@"12" datatype:integer],
+                            [[GTWLiteral alloc] initWithValue:@"2.5" datatype:decimal],
+                            [[GTWLiteral alloc] initWithValue:@"foo"],
+                            [[GTWIRI alloc] initWithValue:@"http://example.org/o"],
+                            ];
+    for (id<GTWTerm> o in objects) {
+        GTWQuad* q  = [[GTWQuad alloc] initWithSubject:s predicate:p object:o graph:g];
+        XCTAssertTrue([store addQuad:q error:nil], @"Quad added");
+    }
+    
+    NSMutableSet* values    = [NSMutableSet set];
+    NSDictionary* ranges    = @{ @"O": [store.gen identifierRangesForIntegerValuesFrom:10 to:20] };
+    BOOL ok = [store enumerateQuadsMatchingSubject:nil predicate:p object:nil graph:nil identifierRanges:ranges usingBlock:^(id<GTWQuad> q) {
+        [values addObject:[q.object value]];
+    } error:nil];
+    XCTAssertTrue(ok, @"Integer range enumeration");
+    XCTAssertEqualObjects(values, [NSSet setWithObject:@"12"], @"Integer range matches only integers in range");
+    
+    [values removeAllObjects];
+    ranges  = @{ @"O": [store.gen identifierRangesForNumericValuesFrom:2 to:4] };
+    ok  = [store enumerateQuadsMatchingSubject:nil predicate:p object:nil graph:nil identifierRanges:ranges usingBlock:^(id<GTWQuad> q) {
+        [values addObject:[q.object value]];
+    } error:nil];
+    XCTAssertTrue(ok, @"Numeric range enumeration");
+    XCTAssertTrue([values containsObject:@"3"], @"Numeric range includes the integer in range");
+    XCTAssertTrue([values containsObject:@"2.5"], @"Numeric range includes inlined decimals");
+    XCTAssertFalse([values containsObject:@"12"], @"Numeric range excludes the integer out of range");
+    XCTAssertFalse([values containsObject:@"foo"], @"Numeric range excludes simple literals");
+    XCTAssertFalse([values containsObject:@"http://example.org/o"], @"Numeric range excludes IRIs");
+}
+
+- (GTWQuad*) quadWithObjectInteger:(NSInteger)value {
+    GTWIRI* s   = [[GTWIRI alloc] initWithValue:@"http://example.org/s"];
+    GTWIRI* p   = [[GTWIRI alloc] initWithValue:@"http://example.org/value"];
+    GTWIRI* g   = [[GTWIRI alloc] initWithValue:@"http://example.org/graph"];
+    GTWLiteral* o   = [[GTWLiteral alloc] initWithValue:[NSString stringWithFormat:@"%lld", (long long)value] datatype:@"http://www.w3.org/2001/XMLSchema#integer"];
+    return [[GTWQuad alloc] initWithSubject:s predicate:p object:o graph:g];
+}
+
+- (NSArray*) objectValuesInQuadStore:(GTWAOFQuadStore*)store {
+    NSMutableArray* values  = [NSMutableArray array];
+    GTWIRI* p   = [[GTWIRI alloc] initWithValue:@"http://example.org/value"];
+    [store enumerateQuadsMatchingSubject:nil predicate:p object:nil graph:nil usingBlock:^(id<GTWQuad> q) {
+        [values addObject:@([[q.object value] integerValue])];
+    } error:nil];
+    return values;
+}
+
+- (void)test_quadStoreDeltaTombstone {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    GTWQuad* q  = [self quadWithObjectInteger:1];
+    XCTAssertTrue([store addQuad:q error:nil], @"Quad added");
+    XCTAssertEqual([store deltaCount], (NSUInteger)1, @"Added quad is in the delta");
+    XCTAssertTrue([store mergeDelta], @"Delta merged");
+    XCTAssertEqual([store deltaCount], (NSUInteger)0, @"Delta is empty after merging");
+    XCTAssertEqual([(GTWAOFBTree*)[store indexes][@"SPOG"] count], (NSInteger)1, @"Merged quad is in the index");
+    
+    XCTAssertTrue([store removeQuad:q error:nil], @"Quad removed");
+    XCTAssertEqual([store deltaCount], (NSUInteger)1, @"Removed quad is in the delta");
+    XCTAssertEqual([(GTWAOFBTree*)[store indexes][@"SPOG"] count], (NSInteger)1, @"Removed quad is still in the index");
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], @[], @"Removed quad is hidden by the delta");
+    
+    XCTAssertTrue([store addQuad:q error:nil], @"Quad re-added");
+    XCTAssertEqual([store deltaCount], (NSUInteger)1, @"Re-added quad replaces the removal in the delta");
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], @[@1], @"Re-added quad is enumerated once");
+}
+
+- (void)test_quadStoreDeltaEnumeration {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    for (NSInteger i = 0; i < 20; i += 2) {
+        [store addQuad:[self quadWithObjectInteger:i] error:nil];
+    }
+    XCTAssertTrue([store mergeDelta], @"Delta merged");
+    
+    // odd values are only in the delta, and two of the indexed even values are removed by it
+    NSMutableArray* expected    = [NSMutableArray array];
+    for (NSInteger i = 1; i < 20; i += 2) {
+        [store addQuad:[self quadWithObjectInteger:i] error:nil];
+    }
+    [store removeQuad:[self quadWithObjectInteger:0] error:nil];
+    [store removeQuad:[self quadWithObjectInteger:10] error:nil];
+    for (NSInteger i = 1; i < 20; i++) {
+        if (i != 10)
+            [expected addObject:@(i)];
+    }
+    XCTAssertEqual([store deltaCount], (NSUInteger)12, @"Delta count");
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], expected, @"Delta and index keys are enumerated together in key order");
+}
+
+- (void)test_quadStoreDeltaMergeThreshold {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    store.deltaMergeThreshold   = 8;
+    NSMutableArray* expected    = [NSMutableArray array];
+    for (NSInteger i = 0; i < 7; i++) {
+        [store addQuad:[self quadWithObjectInteger:i] error:nil];
+        [expected addObject:@(i)];
+    }
+    XCTAssertEqual([store deltaCount], (NSUInteger)7, @"Delta holds updates below the threshold");
+    XCTAssertEqual([(GTWAOFBTree*)[store indexes][@"SPOG"] count], (NSInteger)0, @"Indexes are unchanged below the threshold");
+    
+    [store addQuad:[self quadWithObjectInteger:7] error:nil];
+    [expected addObject:@7];
+    // the merge runs in the background, and the delta stays readable until the merged indexes are swapped in
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], expected, @"Quads are enumerated while the merge is pending");
+    [store waitForScheduledMerge];
+    XCTAssertEqual([store deltaCount], (NSUInteger)0, @"Delta is merged once it reaches the threshold");
+    NSDictionary* indexes   = [store indexes];
+    for (NSString* keyOrder in indexes) {
+        XCTAssertEqual([(GTWAOFBTree*)indexes[keyOrder] count], (NSInteger)8, @"%@ index holds the merged quads", keyOrder);
+    }
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], expected, @"Merged quads are enumerated");
+}
+
+- (void)test_quadStoreDeltaReload {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    [store addQuad:[self quadWithObjectInteger:1] error:nil];
+    [store addQuad:[self quadWithObjectInteger:2] error:nil];
+    XCTAssertTrue([store mergeDelta], @"Delta merged");
+    [store removeQuad:[self quadWithObjectInteger:1] error:nil];
+    [store addQuad:[self quadWithObjectInteger:3] error:nil];
+    
+    // the reopened state replays the added and removed quads pages of the delta
+    GTWAOFQuadStore* reopened   = [[GTWAOFQuadStore alloc] initWithPageID:store.pageID fromAOF:_aof];
+    XCTAssertNotNil(reopened, @"Quad store reopened by page ID");
+    XCTAssertEqual([reopened deltaCount], (NSUInteger)2, @"Reopened delta count");
+    XCTAssertEqualObjects([self objectValuesInQuadStore:reopened], (@[@2, @3]), @"Reopened quad store applies the delta");
+}
+
+- (void)test_quadStoreVersions {
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    NSMutableArray* generations = [NSMutableArray arrayWithObject:@([store generation])];
+    NSMutableArray* dates       = [NSMutableArray arrayWithObject:[store lastModified]];
+    NSMutableArray* contents    = [NSMutableArray arrayWithObject:@[]];
+    NSMutableArray* expected    = [NSMutableArray array];
+    for (NSInteger i = 0; i < 48; i++) {
+        // the first updates only extend the version index every few dozen headers, the later ones also merge the delta
+        store.deltaMergeThreshold   = (i < 40) ? 1000 : 3;
+        [store addQuad:[self quadWithObjectInteger:i] error:nil];
+        [expected addObject:@(i)];
+        [generations addObject:@([store generation])];
+        [dates addObject:[store lastModified]];
+        [contents addObject:[expected copy]];
+    }
+    [store waitForScheduledMerge];
+    
+    NSArray* last   = [[store versionIndex] lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+        return YES;
+    }];
+    XCTAssertNotNil(last, @"Version index has entries");
+    NSInteger missing   = [store generation] - (NSInteger)[last[0] gtw_integerFromBigLongLongRange:NSMakeRange(0, 8)];
+    XCTAssertTrue(missing > 0 && missing <= 32, @"Only the most recent states are missing from the version index (%lld)", (long long)missing);
+    
+    for (NSInteger i = 0; i < [generations count]; i++) {
+        NSInteger generation    = [generations[i] integerValue];
+        GTWAOFQuadStore* state  = [store stateWithGeneration:generation];
+        XCTAssertNotNil(state, @"State with generation %lld", (long long)generation);
+        XCTAssertEqual([state generation], generation, @"State has the requested generation");
+        XCTAssertEqualObjects([self objectValuesInQuadStore:state], contents[i], @"State with generation %lld has the expected quads", (long long)generation);
+    }
+    XCTAssertEqual([store stateWithGeneration:[store generation]], store, @"Current generation is this state");
+    XCTAssertNil([store stateWithGeneration:[store generation]+1], @"No state for a future generation");
+    
+    // timestamps have a resolution of one second, so several states can share one; the latest of them is found (which
+    // may be the header of a background merge, with the same quads as the last update before it)
+    for (NSInteger i = 0; i < [dates count]; i++) {
+        NSInteger j = i;
+        while (j+1 < [dates count] && [dates[j+1] isEqualToDate:dates[i]])
+            j++;
+        GTWAOFQuadStore* state  = [store stateAsOfDate:dates[i]];
+        XCTAssertNotNil(state, @"State as of the date of generation %lld", (long long)[generations[i] integerValue]);
+        XCTAssertTrue([state generation] >= [generations[j] integerValue], @"State as of a date is the latest state committed by then");
+        XCTAssertEqualObjects([self objectValuesInQuadStore:state], contents[j], @"State as of a date has the quads added by then");
+    }
+    XCTAssertNil([store stateAsOfDate:[dates[0] dateByAddingTimeInterval:-1]], @"No state before the quad store was created");
+    XCTAssertEqual([store stateAsOfDate:[NSDate distantFuture]], store, @"State as of a future date is this state");
+    XCTAssertNil([store stateAsOfDate:[NSDate distantPast]], @"No state before the quad store was created");
+}
+
+
+- (void)test_termCacheAdmission {
+    GTWAOFTermCache* cache  = [[GTWAOFTermCache alloc] initWithCostLimit:16*4096];
+    // every hot key is requested a dozen times, filling the main segments with frequently used entries
+    for (NSInteger i = 0; i < 1000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"hot-%lld", (long long)i];
+        [cache objectForKey:key kind:GTWAOFTermCacheTermForID];
+        [cache setObject:key forKey:key kind:GTWAOFTermCacheTermForID cost:64];
+        for (NSInteger j = 0; j < 11; j++) {
+            [cache objectForKey:key kind:GTWAOFTermCacheTermForID];
+        }
+    }
+    NSMutableArray* resident    = [NSMutableArray array];
+    for (NSInteger i = 0; i < 1000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"hot-%lld", (long long)i];
+        if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+            [resident addObject:key];
+    }
+    XCTAssertTrue([resident count] > 0, @"Hot keys are cached");
+    
+    // a scan of keys that are each requested once shouldn't displace the hot set
+    NSUInteger coldCount    = 0;
+    for (NSInteger i = 0; i < 4000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"cold-%lld", (long long)i];
+        [cache objectForKey:key kind:GTWAOFTermCacheTermForID];
+        [cache setObject:key forKey:key kind:GTWAOFTermCacheTermForID cost:64];
+    }
+    for (NSInteger i = 0; i < 4000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"cold-%lld", (long long)i];
+        if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+            coldCount++;
+    }
+    NSUInteger hotCount = 0;
+    for (NSString* key in resident) {
+        if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+            hotCount++;
+    }
+    XCTAssertTrue(hotCount >= (9 * [resident count]) / 10, @"Hot keys survive a scan of cold keys (%lu of %lu)", (unsigned long)hotCount, (unsigned long)[resident count]);
+    XCTAssertTrue(coldCount < 400, @"Cold candidates are rejected when the victim is hot (%lu of 4000 cached)", (unsigned long)coldCount);
+}
+
+- (void)test_termCacheProtectedSegment {
+    GTWAOFTermCache* cache  = [[GTWAOFTermCache alloc] initWithCostLimit:16*4096];
+    for (NSInteger i = 0; i < 1000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"a-%lld", (long long)i];
+        [cache objectForKey:key kind:GTWAOFTermCacheTermForID];
+        [cache setObject:key forKey:key kind:GTWAOFTermCacheTermForID cost:64];
+    }
+    // a second hit promotes an admitted entry from probation to the protected segment
+    NSMutableArray* promoted    = [NSMutableArray array];
+    NSMutableArray* probation   = [NSMutableArray array];
+    for (NSInteger i = 0; i < 1000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"a-%lld", (long long)i];
+        if (i < 100) {
+            if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+                [promoted addObject:key];
+        } else {
+            [probation addObject:key];
+        }
+    }
+    XCTAssertTrue([promoted count] > 0, @"Entries are admitted to the main region");
+    
+    // newcomers requested more often than the probation entries replace them, but not the protected entries
+    for (NSInteger i = 0; i < 1000; i++) {
+        NSString* key   = [NSString stringWithFormat:@"b-%lld", (long long)i];
+        for (NSInteger j = 0; j < 5; j++) {
+            [cache objectForKey:key kind:GTWAOFTermCacheTermForID];
+        }
+        [cache setObject:key forKey:key kind:GTWAOFTermCacheTermForID cost:64];
+    }
+    NSUInteger promotedCount    = 0;
+    for (NSString* key in promoted) {
+        if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+            promotedCount++;
+    }
+    NSUInteger probationCount   = 0;
+    for (NSString* key in probation) {
+        if ([cache objectForKey:key kind:GTWAOFTermCacheTermForID])
+            probationCount++;
+    }
+    XCTAssertTrue(promotedCount >= (9 * [promoted count]) / 10, @"Protected entries survive (%lu of %lu)", (unsigned long)promotedCount, (unsigned long)[promoted count]);
+    XCTAssertTrue(probationCount < [probation count] / 2, @"Probation entries are replaced by more frequent newcomers (%lu of %lu)", (unsigned long)probationCount, (unsigned long)[probation count]);
+}
+
+- (void)test_termCacheCostLimit {
+    GTWAOFTermCache* cache  = [[GTWAOFTermCache alloc] initWithCostLimit:16*4096];
+    for (NSInteger i = 0; i < 5000; i++) {
+        NSNumber* key   = @(i);
+        [cache objectForKey:key kind:GTWAOFTermCacheDataForTerm];
+        [cache setObject:key forKey:key kind:GTWAOFTermCacheDataForTerm cost:(i % 300)];
+        XCTAssertTrue([cache totalCost] <= [cache costLimit], @"Cache cost stays within the limit");
+    }
+    XCTAssertTrue([cache count] > 0, @"Entries are cached");
+    XCTAssertTrue([cache count] < 5000, @"Entries are evicted");
+    
+    NSString* big   = @"big";
+    [cache setObject:big forKey:big kind:GTWAOFTermCacheDataForTerm cost:8192];
+    XCTAssertNil([cache objectForKey:big kind:GTWAOFTermCacheDataForTerm], @"Entries larger than a cache stripe are not cached");
+    XCTAssertTrue([cache totalCost] <= [cache costLimit], @"Cache cost stays within the limit");
+}
+
+- (void)test_termCacheSharedByStates {
+    GTWAOFTermCache* cache  = [GTWAOFTermCache termCacheForAOF:_aof];
+    XCTAssertNotNil(cache, @"Term cache for AOF");
+    XCTAssertEqual([GTWAOFTermCache termCacheForAOF:_aof], cache, @"Term cache is created once per AOF");
+    XCTAssertNotEqual([GTWAOFTermCache termCacheForAOF:[[GTWAOFMemory alloc] init]], cache, @"Other AOFs have their own term cache");
+    
+    GTWMutableAOFQuadStore* store   = [[GTWMutableAOFQuadStore alloc] initWithAOF:_aof];
+    XCTAssertEqual(store.termCache, cache, @"Quad store uses the AOF term cache");
+    for (NSInteger i = 0; i < 3; i++) {
+        [store addQuad:[self quadWithObjectInteger:i] error:nil];
+    }
+    XCTAssertEqualObjects([self objectValuesInQuadStore:store], (@[@0, @1, @2]), @"Quads enumerated");
+    XCTAssertTrue([cache count] > 0, @"Enumeration fills the shared term cache");
+    
+    GTWAOFQuadStore* previous   = [store previousState];
+    XCTAssertNotNil(previous, @"Previous state");
+    XCTAssertEqual(previous.termCache, cache, @"Previous state shares the term cache");
+    GTWAOFQuadStore* reopened   = [[GTWAOFQuadStore alloc] initWithPageID:store.pageID fromAOF:_aof];
+    XCTAssertEqual(reopened.termCache, cache, @"Reopened state shares the term cache");
+    
+    __block GTWAOFQuadStore* rewritten  = nil;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        XCTAssertEqual([GTWAOFTermCache termCacheForAOF:ctx], cache, @"Update context resolves to the AOF term cache");
+        rewritten   = [store rewriteWithUpdateContext:ctx];
+        XCTAssertEqual(rewritten.termCache, cache, @"State created in an update context shares the AOF term cache");
+        return YES;
+    }];
+    XCTAssertNotNil(rewritten, @"Rewritten state");
+    XCTAssertEqual(rewritten.termCache, cache, @"Committed state shares the term cache");
+    XCTAssertEqualObjects([self objectValuesInQuadStore:rewritten], (@[@0, @1, @2]), @"Rewritten state enumerates quads");
+}
+
 @end
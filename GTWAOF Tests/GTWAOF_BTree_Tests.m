@@ -164,7 +164,311 @@
 //    }
 }
 
+- (void)testBTreeRangeEnumeration {
+    int count   = 8000;
+    [self insertDoublesRange:NSMakeRange(0, count)];
+    NSMutableIndexSet* keyset = [NSMutableIndexSet indexSet];
+    NSData* lower   = [NSData gtw_bigLongLongDataWithInteger:1000];
+    NSData* upper   = [NSData gtw_bigLongLongDataWithInteger:4999];
+    [_btree enumerateKeysFrom:lower to:upper usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        NSInteger k = [key gtw_integerFromBigLongLong];
+        NSInteger v = [obj gtw_integerFromBigLongLong];
+        XCTAssert(v == 2*k, @"Range value %lld for key %lld", (long long)v, (long long)k);
+        [keyset addIndex:k];
+    }];
+    XCTAssert([keyset count] == 4000, @"Range size %lld == 4000", (long long)[keyset count]);
+    XCTAssert([keyset firstIndex] == 1000, @"First range key");
+    XCTAssert([keyset lastIndex] == 4999, @"Last range key");
+
+    __block NSInteger openCount = 0;
+    [_btree enumerateKeysFrom:nil to:[NSData gtw_bigLongLongDataWithInteger:9] usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        openCount++;
+    }];
+    XCTAssert(openCount == 10, @"Open lower bound range size %lld == 10", (long long)openCount);
+
+    openCount   = 0;
+    [_btree enumerateKeysFrom:[NSData gtw_bigLongLongDataWithInteger:count-10] to:nil usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        openCount++;
+    }];
+    XCTAssert(openCount == 10, @"Open upper bound range size %lld == 10", (long long)openCount);
+}
+
+- (void)testBTreeInsertBatch {
+    int count   = 4000;
+    // even keys are inserted one at a time, and a batch of keys then fills in the odd keys
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        for (NSInteger k = 0; k < count; k += 2) {
+            [_btree insertValue:[NSData gtw_bigLongLongDataWithInteger:k*2] forKey:[NSData gtw_bigLongLongDataWithInteger:k] updateContext:ctx];
+        }
+        return YES;
+    }];
+    NSMutableArray* keys    = [NSMutableArray array];
+    NSMutableArray* values  = [NSMutableArray array];
+    for (NSInteger k = count-1; k >= 0; k -= 2) {
+        [keys addObject:[NSData gtw_bigLongLongDataWithInteger:k]];
+        [values addObject:[NSData gtw_bigLongLongDataWithInteger:k*2]];
+    }
+    // keys that are already in the tree (or repeated in the batch) are skipped
+    [keys addObject:[NSData gtw_bigLongLongDataWithInteger:0]];
+    [values addObject:[NSData gtw_bigLongLongDataWithInteger:1]];
+    [keys addObject:[NSData gtw_bigLongLongDataWithInteger:1]];
+    [values addObject:[NSData gtw_bigLongLongDataWithInteger:1]];
+    __block NSInteger inserted  = 0;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        inserted    = [_btree insertValues:values forKeys:keys updateContext:ctx];
+        return YES;
+    }];
+    XCTAssert(inserted == count/2, @"Inserted count %lld == %d", (long long)inserted, count/2);
+    XCTAssert([_btree count] == count, @"BTree size %lld == %d", (long long)[_btree count], count);
+    __block NSInteger expected  = 0;
+    __block BOOL ok             = YES;
+    [_btree enumerateKeysAndObjectsUsingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        NSInteger k = [key gtw_integerFromBigLongLong];
+        if (k != expected++ || [obj gtw_integerFromBigLongLong] != 2*k) {
+            ok  = NO;
+            *stop   = YES;
+        }
+    }];
+    XCTAssert(ok, @"Keys are enumerated in order with their values");
+    XCTAssert(expected == count, @"Enumerated size %lld", (long long)expected);
+    XCTAssert([[_btree objectForKey:[NSData gtw_bigLongLongDataWithInteger:0]] gtw_integerFromBigLongLong] == 0, @"Existing value is not replaced");
+}
 
+- (void)testBTreeRemoveN {
+    int count   = 8000;
+    [self insertDoublesRange:NSMakeRange(0, count)];
+    NSMutableArray* keys    = [NSMutableArray array];
+    for (NSInteger k = 1000; k < 6000; k++) {
+        [keys addObject:[NSData gtw_bigLongLongDataWithInteger:k]];
+    }
+    // a key that isn't in the tree is ignored
+    [keys addObject:[NSData gtw_bigLongLongDataWithInteger:count+1]];
+    __block NSInteger removed   = 0;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        removed = [_btree removeValuesForKeys:keys updateContext:ctx];
+        return YES;
+    }];
+    XCTAssert(removed == 5000, @"Removed count %lld == 5000", (long long)removed);
+    XCTAssert([_btree count] == count-5000, @"BTree size %lld == %d", (long long)[_btree count], count-5000);
+    NSMutableIndexSet* keyset = [NSMutableIndexSet indexSet];
+    [_btree enumerateKeysAndObjectsUsingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        [keyset addIndex:[key gtw_integerFromBigLongLong]];
+    }];
+    XCTAssert([keyset count] == count-5000, @"Enumerated size %lld", (long long)[keyset count]);
+    XCTAssert(![keyset intersectsIndexesInRange:NSMakeRange(1000, 5000)], @"Removed keys are not enumerated");
+    XCTAssert([_btree objectForKey:[NSData gtw_bigLongLongDataWithInteger:999]], @"Key before removed range");
+    XCTAssert([_btree objectForKey:[NSData gtw_bigLongLongDataWithInteger:6000]], @"Key after removed range");
+}
+
+- (void)testBTreeRemoveCollapsingLevels {
+    // large keys keep the fanout small, so a few hundred pairs build a tree with several internal levels
+    NSInteger keySize   = 1024;
+    NSInteger count     = 1000;
+    NSMutableArray* pairs   = [NSMutableArray array];
+    for (NSInteger k = 0; k < count; k++) {
+        [pairs addObject:@[[self keyWithInteger:k length:keySize], [NSData data]]];
+    }
+    __block GTWMutableAOFBTree* btree;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        btree   = [[GTWMutableAOFBTree alloc] initBTreeWithKeySize:keySize valueSize:0 pairEnumerator:[pairs objectEnumerator] updateContext:ctx];
+        return YES;
+    }];
+    NSInteger depth = [self depthOfBTree:btree];
+    XCTAssert(depth >= 4, @"BTree depth %lld >= 4", (long long)depth);
+    XCTAssert([btree count] == count, @"BTree size %lld == %lld", (long long)[btree count], (long long)count);
+    
+    // remove all but every 50th key, leaving too few pairs to fill the existing internal levels
+    NSMutableArray* keys        = [NSMutableArray array];
+    NSMutableIndexSet* expected = [NSMutableIndexSet indexSet];
+    for (NSInteger k = 0; k < count; k++) {
+        if (k % 50) {
+            [keys addObject:[self keyWithInteger:k length:keySize]];
+        } else {
+            [expected addIndex:k];
+        }
+    }
+    __block NSInteger removed   = 0;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        removed = [btree removeValuesForKeys:keys updateContext:ctx];
+        return YES;
+    }];
+    XCTAssert(removed == [keys count], @"Removed count %lld == %lld", (long long)removed, (long long)[keys count]);
+    XCTAssert([btree count] == [expected count], @"BTree size %lld == %lld", (long long)[btree count], (long long)[expected count]);
+    NSInteger newDepth  = [self depthOfBTree:btree];
+    XCTAssert(newDepth < depth, @"Internal levels collapsed (depth %lld < %lld)", (long long)newDepth, (long long)depth);
+    
+    __block NSData* last        = nil;
+    __block BOOL ordered        = YES;
+    NSMutableIndexSet* keyset   = [NSMutableIndexSet indexSet];
+    [btree enumerateKeysAndObjectsUsingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        if (last && [last gtw_compare:key] != NSOrderedAscending) {
+            ordered = NO;
+        }
+        last    = key;
+        [keyset addIndex:[[key subdataWithRange:NSMakeRange(0, 8)] gtw_integerFromBigLongLong]];
+    }];
+    XCTAssert(ordered, @"Remaining keys are enumerated in order");
+    XCTAssertEqualObjects(keyset, expected, @"Remaining keys are enumerated");
+    [expected enumerateIndexesUsingBlock:^(NSUInteger k, BOOL *stop) {
+        XCTAssertNotNil([btree objectForKey:[self keyWithInteger:k length:keySize]], @"Remaining key %lld is found", (long long)k);
+    }];
+}
+
+- (void)testBTreeInsertMultiLevel {
+    // large keys keep the fanout small, so single inserts split internal nodes (including the root) several times
+    NSInteger keySize   = 1024;
+    NSInteger count     = 600;
+    __block GTWMutableAOFBTree* btree;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        btree   = [[GTWMutableAOFBTree alloc] initEmptyBTreeWithKeySize:keySize valueSize:8 updateContext:ctx];
+        // even keys first, then odd keys, so later inserts land in (and split) children that are not the last in their parent
+        for (NSInteger k = 0; k < count; k += 2) {
+            [btree insertValue:[NSData gtw_bigLongLongDataWithInteger:k] forKey:[self keyWithInteger:k length:keySize] updateContext:ctx];
+        }
+        for (NSInteger k = 1; k < count; k += 2) {
+            [btree insertValue:[NSData gtw_bigLongLongDataWithInteger:k] forKey:[self keyWithInteger:k length:keySize] updateContext:ctx];
+        }
+        return YES;
+    }];
+    NSInteger depth = [self depthOfBTree:btree];
+    XCTAssert(depth >= 3, @"BTree depth %lld >= 3", (long long)depth);
+    XCTAssert([btree count] == count, @"BTree size %lld == %lld", (long long)[btree count], (long long)count);
+    XCTAssert([[btree root] verify], @"Separators match the max key of each subtree");
+    [self assertBTree:btree hasKeysInRange:NSMakeRange(0, count) length:keySize];
+}
+
+- (void)testBTreeBulkLoadMultiLevel {
+    NSInteger keySize   = 1024;
+    NSInteger count     = 600;
+    NSMutableArray* pairs   = [NSMutableArray array];
+    for (NSInteger k = 0; k < count; k += 2) {
+        [pairs addObject:@[[self keyWithInteger:k length:keySize], [NSData gtw_bigLongLongDataWithInteger:k]]];
+    }
+    __block GTWMutableAOFBTree* btree;
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        btree   = [[GTWMutableAOFBTree alloc] initBTreeWithKeySize:keySize valueSize:8 pairEnumerator:[pairs objectEnumerator] updateContext:ctx];
+        return YES;
+    }];
+    XCTAssert([btree isKindOfClass:[GTWMutableAOFBTree class]], @"Bulk load returns a mutable tree");
+    NSInteger depth = [self depthOfBTree:btree];
+    XCTAssert(depth >= 3, @"BTree depth %lld >= 3", (long long)depth);
+    XCTAssert([btree count] == [pairs count], @"BTree size %lld == %lld", (long long)[btree count], (long long)[pairs count]);
+    XCTAssert([[btree root] verify], @"Separators match the max key of each subtree");
+    
+    // single inserts and replacements into the bulk loaded tree
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        for (NSInteger k = 1; k < count; k += 2) {
+            [btree insertValue:[NSData gtw_bigLongLongDataWithInteger:k] forKey:[self keyWithInteger:k length:keySize] updateContext:ctx];
+        }
+        [btree replaceValue:[NSData gtw_bigLongLongDataWithInteger:0] forKey:[self keyWithInteger:count-2 length:keySize] updateContext:ctx];
+        return YES;
+    }];
+    XCTAssert([btree count] == count, @"BTree size %lld == %lld", (long long)[btree count], (long long)count);
+    XCTAssert([[btree root] verify], @"Separators match the max key of each subtree");
+    NSData* replaced    = [btree objectForKey:[self keyWithInteger:count-2 length:keySize]];
+    XCTAssert([replaced gtw_integerFromBigLongLong] == 0, @"Replaced value");
+    [self assertBTree:btree hasKeysInRange:NSMakeRange(0, count-2) length:keySize];
+}
+
+- (void)testBTreeLastKeyPassingTest {
+    int count   = 8000;
+    [self insertDoublesRange:NSMakeRange(0, count)];
+    for (NSInteger bound = 0; bound < count; bound += 499) {
+        NSArray* pair   = [_btree lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+            return ([key gtw_integerFromBigLongLong] <= bound);
+        }];
+        XCTAssert([pair[0] gtw_integerFromBigLongLong] == bound, @"Last key %lld == %lld", (long long)[pair[0] gtw_integerFromBigLongLong], (long long)bound);
+        XCTAssert([pair[1] gtw_integerFromBigLongLong] == 2*bound, @"Last key value");
+    }
+    NSArray* none   = [_btree lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+        return NO;
+    }];
+    XCTAssert(none == nil, @"No key passes the test");
+    NSArray* last   = [_btree lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+        return YES;
+    }];
+    XCTAssert([last[0] gtw_integerFromBigLongLong] == count-1, @"Every key passes the test");
+}
+
+- (void)testBTreeDifferences {
+    int count   = 8000;
+    [self insertDoublesRange:NSMakeRange(0, count)];
+    GTWAOFBTree* old    = [[GTWAOFBTree alloc] initWithRootPageID:_btree.root.pageID fromAOF:_aof];
+
+    [self insertDoublesRange:NSMakeRange(count, 10)];
+    NSMutableArray* keys    = [NSMutableArray array];
+    for (NSInteger k = 100; k < 200; k++) {
+        [keys addObject:[NSData gtw_bigLongLongDataWithInteger:k]];
+    }
+    [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        [_btree removeValuesForKeys:keys updateContext:ctx];
+        [_btree replaceValue:[NSData gtw_bigLongLongDataWithInteger:0] forKey:[NSData gtw_bigLongLongDataWithInteger:5000] updateContext:ctx];
+        return YES;
+    }];
+
+    NSMutableIndexSet* added    = [NSMutableIndexSet indexSet];
+    NSMutableIndexSet* removed  = [NSMutableIndexSet indexSet];
+    NSMutableIndexSet* changed  = [NSMutableIndexSet indexSet];
+    __block NSInteger lastKey   = -1;
+    [_btree enumerateDifferencesFromBTree:old usingBlock:^(NSData *key, NSData *oldObj, NSData *newObj, BOOL *stop) {
+        NSInteger k = [key gtw_integerFromBigLongLong];
+        XCTAssert(k > lastKey, @"Differences are enumerated in key order");
+        lastKey     = k;
+        if (!oldObj) {
+            [added addIndex:k];
+        } else if (!newObj) {
+            [removed addIndex:k];
+        } else {
+            [changed addIndex:k];
+        }
+    }];
+    XCTAssert([added isEqualToIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(count, 10)]], @"Added keys");
+    XCTAssert([removed isEqualToIndexSet:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(100, 100)]], @"Removed keys");
+    XCTAssert([changed isEqualToIndexSet:[NSIndexSet indexSetWithIndex:5000]], @"Changed keys");
+
+    __block NSInteger same  = 0;
+    [_btree enumerateDifferencesFromBTree:_btree usingBlock:^(NSData *key, NSData *oldObj, NSData *newObj, BOOL *stop) {
+        same++;
+    }];
+    XCTAssert(same == 0, @"A tree has no differences from itself");
+}
+
+
+
+- (NSData*) keyWithInteger:(NSInteger)k length:(NSInteger)length {
+    NSMutableData* key  = [[NSData gtw_bigLongLongDataWithInteger:k] mutableCopy];
+    [key setLength:length];
+    return key;
+}
+
+- (void) assertBTree:(GTWAOFBTree*)btree hasKeysInRange:(NSRange)range length:(NSInteger)length {
+    for (NSInteger k = range.location; k < NSMaxRange(range); k++) {
+        NSData* value   = [btree objectForKey:[self keyWithInteger:k length:length]];
+        XCTAssert([value gtw_integerFromBigLongLong] == k, @"Key %lld is found", (long long)k);
+    }
+    __block NSData* last        = nil;
+    __block BOOL ordered        = YES;
+    NSMutableIndexSet* keyset   = [NSMutableIndexSet indexSet];
+    [btree enumerateKeysAndObjectsUsingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+        if (last && [last gtw_compare:key] != NSOrderedAscending) {
+            ordered = NO;
+        }
+        last    = key;
+        [keyset addIndex:[[key subdataWithRange:NSMakeRange(0, 8)] gtw_integerFromBigLongLong]];
+    }];
+    XCTAssert(ordered, @"Keys are enumerated in order");
+    XCTAssert([keyset containsIndexesInRange:range], @"Keys are enumerated");
+}
+
+- (NSInteger) depthOfBTree:(GTWAOFBTree*)btree {
+    NSInteger depth         = 1;
+    GTWAOFBTreeNode* node   = [btree root];
+    while (node.type == GTWAOFBTreeInternalNodeType) {
+        node    = [GTWAOFBTreeNode nodeWithPageID:[[[node childrenPageIDs] firstObject] integerValue] parent:node fromAOF:_aof];
+        depth++;
+    }
+    return depth;
+}
 
 - (void) insertDoublesRange:(NSRange)range {
     [_aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
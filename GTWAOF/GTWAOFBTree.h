@@ -28,7 +28,10 @@
 - (GTWAOFBTreeNode*) lcaNodeForKeysWithPrefix:(NSData*)prefix;
 - (void)enumerateKeysAndObjectsUsingBlock:(void (^)(NSData* key, NSData* obj, BOOL *stop))block;
 - (void)enumerateKeysAndObjectsMatchingPrefix:(NSData*)prefix usingBlock:(void (^)(NSData* key, NSData* obj, BOOL *stop))block;
+- (void)enumerateKeysFrom:(NSData*)lower to:(NSData*)upper usingBlock:(void (^)(NSData* key, NSData* obj, BOOL *stop))block;
 - (NSData*) objectForKey:(NSData*)key;
+- (NSArray*) lastKeyAndObjectPassingTest:(BOOL (^)(NSData* key))test;
+- (void) enumerateDifferencesFromBTree:(GTWAOFBTree*)old usingBlock:(void (^)(NSData* key, NSData* oldObj, NSData* newObj, BOOL *stop))block;
 - (GTWAOFBTree*) rewriteWithUpdateContext:(GTWAOFUpdateContext*) ctx;
 
 @end
@@ -38,7 +41,9 @@
 - (GTWMutableAOFBTree*) initEmptyBTreeWithKeySize:(NSInteger)keySize valueSize:(NSInteger)valSize updateContext:(GTWAOFUpdateContext*) ctx;
 - (GTWMutableAOFBTree*) initBTreeWithKeySize:(NSInteger)keySize valueSize:(NSInteger)valSize pairEnumerator:(NSEnumerator*)enumerator updateContext:(GTWAOFUpdateContext*) ctx;
 - (BOOL) insertValue:(NSData*)value forKey:(NSData*)key updateContext:(GTWAOFUpdateContext*) ctx;
+- (NSInteger) insertValues:(NSArray*)values forKeys:(NSArray*)keys updateContext:(GTWAOFUpdateContext*) ctx;
 - (BOOL) removeValueForKey:(NSData*)key updateContext:(GTWAOFUpdateContext*) ctx;
+- (NSInteger) removeValuesForKeys:(NSArray*)keys updateContext:(GTWAOFUpdateContext*) ctx;
 - (BOOL) replaceValue:(NSData*)value forKey:(NSData*)key updateContext:(GTWAOFUpdateContext*)ctx;
 
 @end
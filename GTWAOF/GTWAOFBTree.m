@@ -13,6 +13,41 @@
 //static const NSInteger keySize  = 32;
 //static const NSInteger valSize  = 8;
 
+/**
+ An entry on the stack of one side of a B+ tree difference walk: either a node that hasn't been expanded yet
+ (pageID >= 0, with key being its upper key bound, or nil if unbounded), or a key-value pair from a leaf (pageID < 0).
+ */
+@interface GTWAOFBTreeDiffEntry : NSObject
+
+@property (readwrite) NSInteger pageID;
+@property (readwrite) NSData* key;
+@property (readwrite) NSData* value;
+
+@end
+
+@implementation GTWAOFBTreeDiffEntry
+
++ (GTWAOFBTreeDiffEntry*) entryWithPageID:(NSInteger)pageID upperBound:(NSData*)upper {
+    GTWAOFBTreeDiffEntry* e = [[self alloc] init];
+    e.pageID    = pageID;
+    e.key       = upper;
+    return e;
+}
+
++ (GTWAOFBTreeDiffEntry*) entryWithKey:(NSData*)key value:(NSData*)value {
+    GTWAOFBTreeDiffEntry* e = [[self alloc] init];
+    e.pageID    = -1;
+    e.key       = key;
+    e.value     = value;
+    return e;
+}
+
+- (BOOL) isNode {
+    return (self.pageID >= 0);
+}
+
+@end
+
 @implementation GTWAOFBTree
 
 - (GTWAOFBTree*) initFindingBTreeInAOF:(id<GTWAOF,GTWMutableAOF>)aof {
@@ -289,6 +324,200 @@
     }
 }
 
+/**
+ Enumerates the pairs whose keys fall in the inclusive range [lower, upper] (a nil bound leaves that end of the range open).
+ Unlike the prefix enumeration, this seeks directly to the first candidate leaf and stops as soon as a key above the upper bound is seen.
+ */
+- (void)enumerateKeysFrom:(NSData*)lower to:(NSData*)upper usingBlock:(void (^)(NSData* key, NSData* obj, BOOL *stop))block {
+    assert(_aof);
+    if (lower && upper && [lower gtw_compare:upper] == NSOrderedDescending)
+        return;
+    @autoreleasepool {
+        [GTWAOFBTree enumerateKeysAndObjectsForNode:_root from:lower to:upper aof:_aof usingBlock:block];
+    }
+}
+
+/**
+ Returns YES if the enumeration is finished (either the block requested a stop or a key beyond the upper bound was reached).
+ */
++ (BOOL)enumerateKeysAndObjectsForNode:(GTWAOFBTreeNode*)node from:(NSData*)lower to:(NSData*)upper aof:(id<GTWAOF>)aof usingBlock:(void (^)(NSData*, NSData*, BOOL*))block {
+    NSComparisonResult (^cmpData)(NSData* obj1, NSData* obj2) = ^NSComparisonResult(NSData* obj1, NSData* obj2) {
+        return [obj1 gtw_compare:obj2];
+    };
+    NSArray* keys       = [node allKeys];
+    NSUInteger count    = [keys count];
+    NSRange all         = NSMakeRange(0, count);
+    NSUInteger start    = 0;
+    if (lower) {
+        // index of the first key >= lower
+        start   = [keys indexOfObject:lower inSortedRange:all options:NSBinarySearchingInsertionIndex|NSBinarySearchingFirstEqual usingComparator:cmpData];
+    }
+    
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        NSUInteger end  = count;
+        if (upper) {
+            // index just past the last key <= upper
+            end = [keys indexOfObject:upper inSortedRange:all options:NSBinarySearchingInsertionIndex|NSBinarySearchingLastEqual usingComparator:cmpData];
+        }
+        if (end <= start)
+            return (end < count);
+        __block BOOL stopped    = NO;
+        [node enumerateKeysAndObjectsInRange:NSMakeRange(start, end-start) usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+            block(key, obj, &stopped);
+            if (stopped)
+                *stop   = YES;
+        }];
+        return (stopped || end < count);
+    } else {
+        // keys[i] is the maximum key of child i, so the first child that can hold keys >= lower is at the same index
+        NSArray* pageIDs    = [node childrenPageIDs];
+        NSUInteger childCount   = [pageIDs count];
+        for (NSUInteger i = start; i < childCount; i++) {
+            NSNumber* number        = pageIDs[i];
+            GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:[number integerValue] parent:node fromAOF:aof];
+            if ([self enumerateKeysAndObjectsForNode:child from:lower to:upper aof:aof usingBlock:block])
+                return YES;
+            if (upper && i < count && [keys[i] gtw_compare:upper] != NSOrderedAscending) {
+                // every key in the remaining children is greater than the upper bound
+                return YES;
+            }
+        }
+        return NO;
+    }
+}
+
+/**
+ Returns the last @[key, object] pair whose key passes the test, or nil if no key does. The test must be monotonic
+ with respect to key order (YES for every key up to some point, and NO for every key after it), so only the path to
+ that point (and at most one neighboring subtree) is read.
+ */
+- (NSArray*) lastKeyAndObjectPassingTest:(BOOL (^)(NSData* key))test {
+    assert(_aof);
+    return [GTWAOFBTree lastKeyAndObjectForNode:_root aof:_aof passingTest:test];
+}
+
++ (NSArray*) lastKeyAndObjectForNode:(GTWAOFBTreeNode*)node aof:(id<GTWAOF>)aof passingTest:(BOOL (^)(NSData* key))test {
+    NSArray* keys   = [node allKeys];
+    // index of the first key that fails the test
+    NSUInteger lo   = 0;
+    NSUInteger hi   = [keys count];
+    while (lo < hi) {
+        NSUInteger mid  = (lo + hi) / 2;
+        if (test(keys[mid])) {
+            lo  = mid + 1;
+        } else {
+            hi  = mid;
+        }
+    }
+    
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        if (lo == 0)
+            return nil;
+        return @[keys[lo-1], [node allObjects][lo-1]];
+    } else {
+        // keys[i] is the maximum key of child i, so every key in the children before lo passes the test
+        NSArray* pageIDs    = [node childrenPageIDs];
+        for (NSInteger i = lo; i >= 0; i--) {
+            GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:[pageIDs[i] integerValue] parent:node fromAOF:aof];
+            NSArray* pair           = [self lastKeyAndObjectForNode:child aof:aof passingTest:test];
+            if (pair)
+                return pair;
+        }
+        return nil;
+    }
+}
+
+static void expand_diff_entry ( NSMutableArray* stack, id<GTWAOF> aof ) {
+    GTWAOFBTreeDiffEntry* entry = [stack lastObject];
+    [stack removeLastObject];
+    GTWAOFBTreeNode* node       = [GTWAOFBTreeNode nodeWithPageID:entry.pageID parent:nil fromAOF:aof];
+    NSArray* keys               = [node allKeys];
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        NSArray* objects    = [node allObjects];
+        for (NSInteger i = [keys count]-1; i >= 0; i--) {
+            [stack addObject:[GTWAOFBTreeDiffEntry entryWithKey:keys[i] value:objects[i]]];
+        }
+    } else {
+        NSArray* pageIDs    = [node childrenPageIDs];
+        for (NSInteger i = [pageIDs count]-1; i >= 0; i--) {
+            NSData* upper   = (i < [keys count]) ? keys[i] : entry.key;
+            [stack addObject:[GTWAOFBTreeDiffEntry entryWithPageID:[pageIDs[i] integerValue] upperBound:upper]];
+        }
+    }
+}
+
+static NSComparisonResult compare_upper_bounds ( NSData* a, NSData* b ) {
+    if (!a && !b)
+        return NSOrderedSame;
+    if (!a)
+        return NSOrderedDescending;
+    if (!b)
+        return NSOrderedAscending;
+    return [a gtw_compare:b];
+}
+
+/**
+ Enumerates, in key order, the pairs that differ between the old tree and this one: keys only in the old tree
+ (newObj is nil), keys only in this tree (oldObj is nil), and keys whose values differ. Both trees are walked at
+ once and subtrees that share a page (the common case for copy-on-write versions of the same tree) are skipped
+ without being read, so the cost is proportional to the number of changed pages rather than the size of the trees.
+ */
+- (void) enumerateDifferencesFromBTree:(GTWAOFBTree*)old usingBlock:(void (^)(NSData* key, NSData* oldObj, NSData* newObj, BOOL *stop))block {
+    assert(_aof);
+    NSMutableArray* a   = [NSMutableArray array];
+    NSMutableArray* b   = [NSMutableArray array];
+    if (old)
+        [a addObject:[GTWAOFBTreeDiffEntry entryWithPageID:old.root.pageID upperBound:nil]];
+    [b addObject:[GTWAOFBTreeDiffEntry entryWithPageID:_root.pageID upperBound:nil]];
+    
+    BOOL stop   = NO;
+    @autoreleasepool {
+        while (!stop) {
+            GTWAOFBTreeDiffEntry* ea    = [a lastObject];
+            GTWAOFBTreeDiffEntry* eb    = [b lastObject];
+            if (!ea && !eb)
+                break;
+            if ([ea isNode] && [eb isNode]) {
+                if (ea.pageID == eb.pageID) {
+                    [a removeLastObject];
+                    [b removeLastObject];
+                } else {
+                    // expand the node covering the wider key range so that shared subtrees line up
+                    NSComparisonResult c    = compare_upper_bounds(ea.key, eb.key);
+                    if (c != NSOrderedAscending)
+                        expand_diff_entry(a, old.aof);
+                    if (c != NSOrderedDescending)
+                        expand_diff_entry(b, _aof);
+                }
+            } else if ([ea isNode]) {
+                expand_diff_entry(a, old.aof);
+            } else if ([eb isNode]) {
+                expand_diff_entry(b, _aof);
+            } else if (!eb) {
+                block(ea.key, ea.value, nil, &stop);
+                [a removeLastObject];
+            } else if (!ea) {
+                block(eb.key, nil, eb.value, &stop);
+                [b removeLastObject];
+            } else {
+                NSComparisonResult c    = [ea.key gtw_compare:eb.key];
+                if (c == NSOrderedAscending) {
+                    block(ea.key, ea.value, nil, &stop);
+                    [a removeLastObject];
+                } else if (c == NSOrderedDescending) {
+                    block(eb.key, nil, eb.value, &stop);
+                    [b removeLastObject];
+                } else {
+                    if (![ea.value isEqual:eb.value])
+                        block(ea.key, ea.value, eb.value, &stop);
+                    [a removeLastObject];
+                    [b removeLastObject];
+                }
+            }
+        }
+    }
+}
+
 static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, GTWAOFBTreeNode* node ) {
     if (node.type == GTWAOFBTreeInternalNodeType) {
         NSArray* keys   = [node allKeys];
@@ -323,6 +552,81 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
 @end
 
 
+/**
+ An in-memory node used while rewriting the tree for a batch of insertions or removals. A pending node either refers
+ to an unmodified node already in the AOF (pageID >= 0), or holds the keys and values (objects for leaves, children
+ page IDs for internal nodes) of a node that has not yet been written. maxKey is the largest key in the node's
+ subtree, which is the separator its parent uses for it. It is carried along as nodes are rewritten, merged and split
+ so that separators never need to be re-read from the AOF, and is nil only for nodes on the rightmost path of the
+ tree, which never need a separator.
+ */
+@interface GTWAOFBTreePendingNode : NSObject
+
+@property (readwrite) GTWAOFBTreeNodeType type;
+@property (readwrite) NSInteger pageID;
+@property (readwrite) NSData* maxKey;
+@property (readwrite) NSMutableArray* keys;
+@property (readwrite) NSMutableArray* values;
+
+@end
+
+@implementation GTWAOFBTreePendingNode
+
++ (GTWAOFBTreePendingNode*) pendingLeafNode {
+    GTWAOFBTreePendingNode* p   = [[self alloc] init];
+    p.type      = GTWAOFBTreeLeafNodeType;
+    p.pageID    = -1;
+    p.keys      = [NSMutableArray array];
+    p.values    = [NSMutableArray array];
+    return p;
+}
+
++ (GTWAOFBTreePendingNode*) pendingInternalNode {
+    GTWAOFBTreePendingNode* p   = [self pendingLeafNode];
+    p.type      = GTWAOFBTreeInternalNodeType;
+    return p;
+}
+
++ (GTWAOFBTreePendingNode*) pendingNodeWithPageID:(NSInteger)pageID maxKey:(NSData*)maxKey {
+    GTWAOFBTreePendingNode* p   = [[self alloc] init];
+    p.pageID    = pageID;
+    p.maxKey    = maxKey;
+    return p;
+}
+
++ (GTWAOFBTreePendingNode*) pendingNodeWithNode:(GTWAOFBTreeNode*)node {
+    GTWAOFBTreePendingNode* p   = [[self alloc] init];
+    p.type      = node.type;
+    p.pageID    = -1;
+    p.keys      = [[node allKeys] mutableCopy];
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        p.values    = [[node allObjects] mutableCopy];
+    } else {
+        p.values    = [[node childrenPageIDs] mutableCopy];
+    }
+    return p;
+}
+
+- (void) materializeFromAOF:(id<GTWAOF>)aof {
+    if (self.pageID < 0)
+        return;
+    GTWAOFBTreeNode* node   = [GTWAOFBTreeNode nodeWithPageID:self.pageID parent:nil fromAOF:aof];
+    GTWAOFBTreePendingNode* p   = [GTWAOFBTreePendingNode pendingNodeWithNode:node];
+    self.type   = p.type;
+    self.keys   = p.keys;
+    self.values = p.values;
+    self.pageID = -1;
+}
+
+- (BOOL) isEmpty {
+    if (self.pageID >= 0)
+        return NO;
+    return ([self.values count] == 0);
+}
+
+@end
+
+
 @implementation GTWMutableAOFBTree
 
 - (GTWMutableAOFBTree*) initFindingBTreeInAOF:(id<GTWAOF,GTWMutableAOF>)aof {
@@ -419,6 +723,8 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
     NSArray* array  = [self nodeArraysWithEnumerator:enumerator withMininumCount:minLeaf maximumCount:fillLeaf];
     if ([array count]) {
         NSMutableArray* pages   = [NSMutableArray array];
+        // the max key of each page's subtree, used as the page's separator in the level above
+        NSMutableDictionary* maxKeys    = [NSMutableDictionary dictionary];
         NSInteger i;
         BOOL root = ([array count] == 1) ? YES : NO;
         for (i = 0; i < [array count]; i++) {
@@ -431,6 +737,7 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
             }
             GTWMutableAOFBTreeNode* node    = [[GTWMutableAOFBTreeNode alloc] initLeafWithParent:nil isRoot:root keySize:keySize valueSize:valSize keys:keys objects:vals updateContext:ctx];
 //            NSLog(@"Leaf node (root=%d) %lld: %lld data pairs", root, (long long)node.pageID, (long long)[node count]);
+            maxKeys[@(node.pageID)] = [keys lastObject];
             [pages addObject:node];
         }
         
@@ -443,19 +750,26 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
                 NSMutableArray* vals    = [NSMutableArray array];
                 for (i = 0; i < [leaf count]; i++) {
                     GTWMutableAOFBTreeNode* child   = leaf[i];
-                    NSData* maxKey  = [child maxKey];
                     NSInteger pageID    = child.pageID;
+                    NSData* maxKey  = maxKeys[@(pageID)];
                     [keys addObject:maxKey];
                     [vals addObject:@(pageID)];
                 }
+                NSData* subtreeMax  = [keys lastObject];
                 [keys removeLastObject];
                 GTWMutableAOFBTreeNode* node    = [[GTWMutableAOFBTreeNode alloc] initInternalWithParent:nil isRoot:root keySize:keySize valueSize:valSize keys:keys pageIDs:vals updateContext:ctx];
+                maxKeys[@(node.pageID)] = subtreeMax;
 //                NSLog(@"Internal node (root=%d) %lld: %lld children", root, (long long)node.pageID, (long long)[[node childrenPageIDs] count]);
                 [pages addObject:node];
                 NSLog(@"-------");
             }
         }
-        return pages[0];
+        if (self = [super init]) {
+            self.aof    = ctx;
+            [ctx registerPageObject:self];
+            _root   = pages[0];
+        }
+        return self;
     } else {
         return [self initEmptyBTreeWithKeySize:keySize valueSize:valSize updateContext:ctx];
     }
@@ -525,7 +839,7 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
         //        NSLog(@"splitting the root");
         GTWAOFBTreeNode* lhs    = pair[0];
         GTWAOFBTreeNode* rhs    = pair[1];
-        NSArray* rootKeys       = @[[lhs maxKey]];
+        NSArray* rootKeys       = @[pair[2]];
         NSArray* rootPageIDs    = @[@(lhs.pageID), @(rhs.pageID)];
         //        NSLog(@"%@ %@", rootKeys, rootPageIDs);
         _root   = [[GTWMutableAOFBTreeNode alloc] initInternalWithParent:nil isRoot:YES keySize:splitnode.keySize valueSize:splitnode.valSize keys:rootKeys pageIDs:rootPageIDs updateContext:ctx];
@@ -558,121 +872,419 @@ static GTWAOFBTreeNode* copy_btree ( id<GTWAOF> aof, GTWAOFUpdateContext* ctx, G
     return YES;
 }
 
-- (BOOL) removeValueForKey:(NSData*)key updateContext:(GTWAOFUpdateContext*) ctx {
-    GTWAOFBTreeNode* leaf   = [self leafNodeForKey:key];
-    NSData* value   = [leaf objectForKey:key];
-    if (!value)
-        return NO;
-    if (!leaf.isMinimum) {
-        NSLog(@"Leaf won't underflow (%lld pairs); removing...", (long long)[leaf nodeItemCount]);
-        GTWAOFBTreeNode* newnode    = [GTWMutableAOFBTreeNode rewriteLeafNode:leaf removingObjectForKey:key updateContext:ctx];
-        _root   = [self rewriteToRootFromNewNode:newnode replacingOldNode:leaf updateContext:ctx];
-    } else if (leaf.isRoot) {
-        NSLog(@"Leaf would underflow (%lld pairs), but it is the root; special case removing...", (long long)[leaf nodeItemCount]);
-        GTWAOFBTreeNode* newnode    = [GTWMutableAOFBTreeNode rewriteLeafNode:leaf removingObjectForKey:key updateContext:ctx];
-        _root   = [self rewriteToRootFromNewNode:newnode replacingOldNode:leaf updateContext:ctx];
-    } else {
-        NSLog(@"Leaf would underflow (%lld pairs); trying to combine with sibling", (long long)[leaf nodeItemCount]);
-        // find a sibling
-        GTWAOFBTreeNode* sibling    = [leaf fullestSibling];
-        NSLog(@"fullest sibling: %@", sibling);
-        NSInteger combined  = [leaf nodeItemCount] + [sibling nodeItemCount];
-        if (combined >= [leaf minLeafPageKeys]) {
-            // if the sibling and this node have enough pairs to not underflow, redistribute the pairs, write a new leaf node from the siblings' data, rewrite the parent, and rewrite the path from the parent to the root
-            NSLog(@"-> can combine with sibling (%lld total pairs)", (long long)combined);
-            NSMutableArray* array   = [NSMutableArray array];
-            NSMutableArray* keys    = [NSMutableArray array];
-            if ([leaf.maxKey gtw_compare:sibling.maxKey] == NSOrderedAscending) {
-                [array addObjectsFromArray:[leaf allObjects]];
-                [keys addObjectsFromArray:[leaf allKeys]];
-                [array addObjectsFromArray:[sibling allObjects]];
-                [keys addObjectsFromArray:[sibling allKeys]];
-            } else {
-                [array addObjectsFromArray:[sibling allObjects]];
-                [keys addObjectsFromArray:[sibling allKeys]];
-                [array addObjectsFromArray:[leaf allObjects]];
-                [keys addObjectsFromArray:[leaf allKeys]];
-            }
+/**
+ Inserts the pairs for all of the given keys in a single pass over the tree; keys that are already in the tree are
+ skipped, and only the first value given for a repeated key is used. Each leaf and internal node that is touched is rewritten once, with overflowing nodes split evenly into as
+ many nodes as are needed to hold the new pairs.
+ 
+ Returns the number of pairs that were inserted.
+ */
+- (NSInteger) insertValues:(NSArray*)values forKeys:(NSArray*)keys updateContext:(GTWAOFUpdateContext*)ctx {
+    assert([values count] == [keys count]);
+#if DEBUG
+    NSInteger count = [self count];
+#endif
+    NSMutableArray* pairs   = [NSMutableArray arrayWithCapacity:[keys count]];
+    for (NSUInteger i = 0; i < [keys count]; i++) {
+        [pairs addObject:@[keys[i], values[i]]];
+    }
+    // a stable sort keeps the first of any repeated keys first, so its value is the one inserted
+    [pairs sortWithOptions:NSSortStable usingComparator:^NSComparisonResult(NSArray* obj1, NSArray* obj2) {
+        return [obj1[0] gtw_compare:obj2[0]];
+    }];
+    if (![pairs count])
+        return 0;
+    
+    NSInteger inserted  = 0;
+    NSArray* nodes      = [self pendingNodesByInsertingPairs:pairs intoNode:_root insertedCount:&inserted updateContext:ctx];
+    if (!nodes)
+        return 0;
+    
+    // a root that overflowed is split, and the new nodes become the children of a new root
+    while ([nodes count] > 1) {
+        nodes   = [self pendingInternalNodesWithEntries:[self writtenEntriesForPendingNodes:nodes updateContext:ctx]];
+    }
+    _root   = [self writePendingNode:nodes[0] root:YES updateContext:ctx];
+    
+#if DEBUG
+    NSInteger newcount = [self count];
+    if ((count+inserted) != newcount) {
+        NSLog(@"BTree insertValues:forKeys: has bad count after inserting %lld with starting count %lld", (long long)inserted, (long long)count);
+        assert(0);
+    }
+#endif
+    return inserted;
+}
 
-            NSInteger keycount      = [keys count];
-            for (NSInteger i = 0; i < keycount; i++) {
-                if ([keys[i] gtw_compare:key] == NSOrderedSame) {
-                    [keys removeObjectAtIndex:i];
-                    [array removeObjectAtIndex:i];
-                    break;
-                }
+/**
+ Returns the pending nodes that replace node after inserting the sorted pairs into its subtree, or nil if all of the
+ pairs' keys are already present.
+ */
+- (NSArray*) pendingNodesByInsertingPairs:(NSArray*)pairs intoNode:(GTWAOFBTreeNode*)node insertedCount:(NSInteger*)inserted updateContext:(GTWAOFUpdateContext*)ctx {
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        NSArray* nodeKeys       = [node allKeys];
+        NSArray* nodeObjects    = [node allObjects];
+        NSUInteger nodecount    = [nodeKeys count];
+        NSUInteger paircount    = [pairs count];
+        NSMutableArray* keys    = [NSMutableArray arrayWithCapacity:nodecount+paircount];
+        NSMutableArray* values  = [NSMutableArray arrayWithCapacity:nodecount+paircount];
+        NSInteger insertedHere  = 0;
+        NSUInteger i = 0, j = 0;
+        while (i < nodecount || j < paircount) {
+            NSComparisonResult r;
+            if (i < nodecount && j < paircount) {
+                r   = [nodeKeys[i] gtw_compare:pairs[j][0]];
+            } else {
+                r   = (i < nodecount) ? NSOrderedAscending : NSOrderedDescending;
             }
-            
-            GTWAOFBTreeNode* newleaf    = [[GTWMutableAOFBTreeNode alloc] initLeafWithParent:leaf.parent isRoot:NO keySize:leaf.keySize valueSize:leaf.valSize keys:keys objects:array updateContext:ctx];
-            GTWAOFBTreeNode* oldparent  = leaf.parent;
-            if (!oldparent.isMinimum) {
-                GTWAOFBTreeNode* newparent  = [GTWMutableAOFBTreeNode rewriteInternalNode:oldparent replacingChildren:@[leaf, sibling] withNewNode:newleaf updateContext:ctx];
-                _root       = [self rewriteToRootFromNewNode:newparent replacingOldNode:oldparent updateContext:ctx];
-            } else if (oldparent.isRoot) {
-                NSLog(@"parent would underflow, but it is the root; special case removing...");
-                GTWAOFBTreeNode* newparent  = [GTWMutableAOFBTreeNode rewriteInternalNode:oldparent replacingChildren:@[leaf, sibling] withNewNode:newleaf updateContext:ctx];
-                _root       = newparent;
+            if (r == NSOrderedDescending) {
+                NSArray* pair   = pairs[j++];
+                if ([[keys lastObject] isEqual:pair[0]])
+                    continue;
+                [keys addObject:pair[0]];
+                [values addObject:pair[1]];
+                insertedHere++;
             } else {
-                NSLog(@"parent would underflow: %@", oldparent);
-                assert(0);
+                if (r == NSOrderedSame)
+                    j++;
+                [keys addObject:nodeKeys[i]];
+                [values addObject:nodeObjects[i]];
+                i++;
             }
-        } else {
-            NSLog(@"-> cannot combine with sibling (%lld total pairs)", (long long)combined);
-            assert(0);
         }
+        if (!insertedHere)
+            return nil;
+        *inserted   += insertedHere;
         
-        
-        // else (the sibling and this node are both minimal)
-            // mergenode = merge the siblings
-            // mergeparent = parent of siblings
-//    LOOP:
-            // if mergeparent is minimal AND mergeparent is NOT root
-                // find a parentsibling of mergeparent
-                // if the parentsibling and mergeparent have enough children to not underflow, redistribute the children, rewrite the grandparent, and rewrite the path from the grandparent to the root
-                // else (the mergeparent and parentsibling are both minimal)
-                    // mergeparent = parent of mergeparent
-                    // mergenode = merge mergeparent and parentsibling
-                    // goto LOOP
-                // end
-            // else
-                // replace siblings in mergeparent with mergenode
-                // rewrite the path from rewritten mergeparent to root
-            // end
-        // end
-        
-        return YES;
-        assert(0);
-        
-        GTWAOFBTreeNode* mergenode    = leaf;
-        
-        
-        
-        NSArray* pair   = [GTWMutableAOFBTreeNode splitLeafNode:mergenode addingObject:value forKey:key updateContext:ctx];
-        //        NSLog(@"split leaf: %@", pair);
-        while (![mergenode isRoot]) {
-            GTWAOFBTreeNode* oldparent = mergenode.parent;
-            NSArray* parentpair     = [GTWMutableAOFBTreeNode splitOrReplaceInternalNode:oldparent replacingChildID:mergenode.pageID withNewNodes:pair updateContext:ctx];
-            if ([parentpair count] == 1) {
-                // the parent had room for the new pages. rewrite to root and return.
-                GTWAOFBTreeNode* newnode = parentpair[0];
-                GTWAOFBTreeNode* oldnode = oldparent;
-                _root       = [self rewriteToRootFromNewNode:newnode replacingOldNode:oldnode updateContext:ctx];
-                return YES;
+        NSInteger max       = [GTWAOFBTreeNode maxLeafPageKeysForKeySize:self.keySize valueSize:self.valSize];
+        NSMutableArray* nodes   = [NSMutableArray array];
+        for (NSValue* value in [self rangesSplittingCount:[keys count] maximumCount:max]) {
+            NSRange range   = [value rangeValue];
+            GTWAOFBTreePendingNode* pending = [GTWAOFBTreePendingNode pendingLeafNode];
+            pending.keys    = [[keys subarrayWithRange:range] mutableCopy];
+            pending.values  = [[values subarrayWithRange:range] mutableCopy];
+            pending.maxKey  = [pending.keys lastObject];
+            [nodes addObject:pending];
+        }
+        return nodes;
+    }
+    
+    NSArray* separators     = [node allKeys];
+    NSArray* ids            = [node childrenPageIDs];
+    NSUInteger paircount    = [pairs count];
+    NSUInteger sepcount     = [separators count];
+    NSUInteger childcount   = [ids count];
+    NSMutableArray* entries = [NSMutableArray arrayWithCapacity:childcount];
+    BOOL changed            = NO;
+    NSUInteger k            = 0;
+    for (NSUInteger i = 0; i < childcount; i++) {
+        // keys <= separators[i] belong to child i; the remaining keys belong to the last child
+        NSUInteger end  = paircount;
+        if (i < sepcount) {
+            end = k;
+            while (end < paircount && [pairs[end][0] gtw_compare:separators[i]] != NSOrderedDescending) {
+                end++;
+            }
+        }
+        NSData* maxKey  = (i < sepcount) ? separators[i] : nil;
+        NSArray* nodes  = nil;
+        if (end > k) {
+            GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:[ids[i] integerValue] parent:node fromAOF:ctx];
+            nodes   = [self pendingNodesByInsertingPairs:[pairs subarrayWithRange:NSMakeRange(k, end-k)] intoNode:child insertedCount:inserted updateContext:ctx];
+        }
+        k   = end;
+        if (nodes) {
+            changed = YES;
+            GTWAOFBTreePendingNode* last    = [nodes lastObject];
+            if (last.type == GTWAOFBTreeInternalNodeType) {
+                // the child's key range is unchanged, so its separator still bounds the last of the new nodes
+                last.maxKey = maxKey;
+            }
+            [entries addObjectsFromArray:[self writtenEntriesForPendingNodes:nodes updateContext:ctx]];
+        } else {
+            [entries addObject:[GTWAOFBTreePendingNode pendingNodeWithPageID:[ids[i] integerValue] maxKey:maxKey]];
+        }
+    }
+    
+    if (!changed)
+        return nil;
+    return [self pendingInternalNodesWithEntries:entries];
+}
+
+/**
+ Writes the pending nodes, returning entries that refer to the written pages.
+ */
+- (NSArray*) writtenEntriesForPendingNodes:(NSArray*)nodes updateContext:(GTWAOFUpdateContext*)ctx {
+    NSMutableArray* entries = [NSMutableArray arrayWithCapacity:[nodes count]];
+    for (GTWAOFBTreePendingNode* pending in nodes) {
+        GTWAOFBTreeNode* newnode    = [self writePendingNode:pending root:NO updateContext:ctx];
+        [entries addObject:[GTWAOFBTreePendingNode pendingNodeWithPageID:newnode.pageID maxKey:pending.maxKey]];
+    }
+    return entries;
+}
+
+/**
+ Groups entries for written nodes into as few pending internal nodes as can hold them, spreading the entries evenly.
+ */
+- (NSArray*) pendingInternalNodesWithEntries:(NSArray*)entries {
+    NSInteger max           = [GTWAOFBTreeNode maxInternalPageKeysForKeySize:self.keySize] + 1;
+    NSMutableArray* nodes   = [NSMutableArray array];
+    for (NSValue* value in [self rangesSplittingCount:[entries count] maximumCount:max]) {
+        NSRange range   = [value rangeValue];
+        GTWAOFBTreePendingNode* pending = [GTWAOFBTreePendingNode pendingInternalNode];
+        for (NSUInteger i = range.location; i < NSMaxRange(range); i++) {
+            GTWAOFBTreePendingNode* entry   = entries[i];
+            [pending.values addObject:@(entry.pageID)];
+            if (i < (NSMaxRange(range)-1)) {
+                [pending.keys addObject:entry.maxKey];
             } else {
-                mergenode   = oldparent;
-                pair        = parentpair;
+                pending.maxKey  = entry.maxKey;
             }
         }
-        // splitting the root
-        GTWAOFBTreeNode* lhs    = pair[0];
-        GTWAOFBTreeNode* rhs    = pair[1];
-        NSArray* rootKeys       = @[[lhs maxKey]];
-        NSArray* rootPageIDs    = @[@(lhs.pageID), @(rhs.pageID)];
-        _root   = [[GTWMutableAOFBTreeNode alloc] initInternalWithParent:nil isRoot:YES keySize:mergenode.keySize valueSize:mergenode.valSize keys:rootKeys pageIDs:rootPageIDs updateContext:ctx];
+        [nodes addObject:pending];
+    }
+    return nodes;
+}
+
+/**
+ Returns the ranges that split count items into the fewest runs of at most max items, with the items spread evenly
+ across the runs.
+ */
+- (NSArray*) rangesSplittingCount:(NSUInteger)count maximumCount:(NSUInteger)max {
+    NSUInteger runs         = (count + max - 1) / max;
+    NSMutableArray* ranges  = [NSMutableArray arrayWithCapacity:runs];
+    NSUInteger start        = 0;
+    for (NSUInteger i = 0; i < runs; i++) {
+        NSUInteger end  = (count * (i+1)) / runs;
+        [ranges addObject:[NSValue valueWithRange:NSMakeRange(start, end-start)]];
+        start   = end;
     }
-    return NO;
+    return ranges;
 }
 
+- (BOOL) removeValueForKey:(NSData*)key updateContext:(GTWAOFUpdateContext*) ctx {
+    NSInteger removed   = [self removeValuesForKeys:@[key] updateContext:ctx];
+    return (removed > 0) ? YES : NO;
+}
+
+/**
+ Removes the pairs for all of the given keys in a single pass over the tree. Each leaf and internal node that
+ is touched is rewritten once, and underflowing nodes are merged with (or redistributed into) their siblings
+ before any of the rewritten pages are written.
+ 
+ Returns the number of pairs that were removed.
+ */
+- (NSInteger) removeValuesForKeys:(NSArray*)keys updateContext:(GTWAOFUpdateContext*) ctx {
+#if DEBUG
+    NSInteger count = [self count];
+#endif
+    NSArray* sorted = [keys sortedArrayUsingComparator:^NSComparisonResult(NSData* obj1, NSData* obj2) {
+        return [obj1 gtw_compare:obj2];
+    }];
+    if (![sorted count])
+        return 0;
+    
+    NSInteger removed   = 0;
+    GTWAOFBTreePendingNode* pending = [self pendingNodeByRemovingKeys:sorted fromNode:_root maxKey:nil removedCount:&removed updateContext:ctx];
+    if (!pending)
+        return 0;
+    
+    // an internal root left with a single child is replaced by that child
+    while (pending.type == GTWAOFBTreeInternalNodeType && [pending.values count] == 1) {
+        GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:[pending.values[0] integerValue] parent:nil fromAOF:ctx];
+        pending = [GTWAOFBTreePendingNode pendingNodeWithNode:child];
+    }
+    if (pending.type == GTWAOFBTreeInternalNodeType && [pending.values count] == 0) {
+        pending = [GTWAOFBTreePendingNode pendingLeafNode];
+    }
+    _root   = [self writePendingNode:pending root:YES updateContext:ctx];
+    
+#if DEBUG
+    NSInteger newcount = [self count];
+    if ((count-removed) != newcount) {
+        NSLog(@"BTree removeValuesForKeys: has bad count after removing %lld with starting count %lld", (long long)removed, (long long)count);
+        assert(0);
+    }
+#endif
+    return removed;
+}
+
+- (GTWAOFBTreePendingNode*) pendingNodeByRemovingKeys:(NSArray*)keys fromNode:(GTWAOFBTreeNode*)node maxKey:(NSData*)nodeMaxKey removedCount:(NSInteger*)removed updateContext:(GTWAOFUpdateContext*)ctx {
+    if (node.type == GTWAOFBTreeLeafNodeType) {
+        NSSet* remove           = [NSSet setWithArray:keys];
+        NSArray* nodeKeys       = [node allKeys];
+        NSArray* nodeObjects    = [node allObjects];
+        GTWAOFBTreePendingNode* pending = [GTWAOFBTreePendingNode pendingLeafNode];
+        NSInteger count         = [nodeKeys count];
+        for (NSInteger i = 0; i < count; i++) {
+            NSData* key = nodeKeys[i];
+            if (![remove containsObject:key]) {
+                [pending.keys addObject:key];
+                [pending.values addObject:nodeObjects[i]];
+            }
+        }
+        NSInteger removedHere   = count - [pending.keys count];
+        if (!removedHere)
+            return nil;
+        *removed    += removedHere;
+        pending.maxKey  = [pending.keys lastObject];
+        return pending;
+    }
+    
+    NSArray* separators     = [node allKeys];
+    NSArray* ids            = [node childrenPageIDs];
+    NSUInteger keycount     = [keys count];
+    NSUInteger sepcount     = [separators count];
+    NSUInteger childcount   = [ids count];
+    NSMutableArray* entries = [NSMutableArray arrayWithCapacity:childcount];
+    BOOL changed            = NO;
+    NSUInteger k            = 0;
+    for (NSUInteger i = 0; i < childcount; i++) {
+        // keys <= separators[i] belong to child i; the remaining keys belong to the last child
+        NSUInteger end  = keycount;
+        if (i < sepcount) {
+            end = k;
+            while (end < keycount && [keys[end] gtw_compare:separators[i]] != NSOrderedDescending) {
+                end++;
+            }
+        }
+        NSData* maxKey  = (i < sepcount) ? separators[i] : nodeMaxKey;
+        GTWAOFBTreePendingNode* entry   = nil;
+        if (end > k) {
+            GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:[ids[i] integerValue] parent:node fromAOF:ctx];
+            entry   = [self pendingNodeByRemovingKeys:[keys subarrayWithRange:NSMakeRange(k, end-k)] fromNode:child maxKey:maxKey removedCount:removed updateContext:ctx];
+        }
+        k   = end;
+        if (entry) {
+            changed = YES;
+            if ([entry isEmpty])
+                continue;
+        } else {
+            entry   = [GTWAOFBTreePendingNode pendingNodeWithPageID:[ids[i] integerValue] maxKey:maxKey];
+        }
+        [entries addObject:entry];
+    }
+    
+    if (!changed)
+        return nil;
+    
+    [self rebalancePendingNodes:entries updateContext:ctx];
+    
+    GTWAOFBTreePendingNode* pending = [GTWAOFBTreePendingNode pendingInternalNode];
+    NSUInteger entrycount   = [entries count];
+    for (NSUInteger i = 0; i < entrycount; i++) {
+        GTWAOFBTreePendingNode* entry   = entries[i];
+        if (entry.pageID < 0) {
+            GTWAOFBTreeNode* newnode    = [self writePendingNode:entry root:NO updateContext:ctx];
+            entry.pageID    = newnode.pageID;
+        }
+        [pending.values addObject:@(entry.pageID)];
+        if (i < (entrycount-1)) {
+            [pending.keys addObject:entry.maxKey];
+        }
+    }
+    pending.maxKey  = [[entries lastObject] maxKey];
+    return pending;
+}
+
+- (BOOL) pendingNodeIsUnderfull:(GTWAOFBTreePendingNode*)pending {
+    if (pending.pageID >= 0) {
+        // unmodified nodes are assumed to already satisfy the minimum fill constraint
+        return NO;
+    }
+    NSInteger keySize   = self.keySize;
+    if (pending.type == GTWAOFBTreeLeafNodeType) {
+        NSInteger min   = [GTWAOFBTreeNode maxLeafPageKeysForKeySize:keySize valueSize:self.valSize]/2;
+        return ([pending.keys count] < min);
+    } else {
+        NSInteger min   = [GTWAOFBTreeNode maxInternalPageKeysForKeySize:keySize]/2;
+        return ([pending.keys count] < min);
+    }
+}
+
+/**
+ Merges each underflowing node with an adjacent sibling, splitting the merged node evenly if it would overflow.
+ */
+- (void) rebalancePendingNodes:(NSMutableArray*)entries updateContext:(GTWAOFUpdateContext*)ctx {
+    NSUInteger i    = 0;
+    while (i < [entries count] && [entries count] > 1) {
+        GTWAOFBTreePendingNode* entry   = entries[i];
+        if (![self pendingNodeIsUnderfull:entry]) {
+            i++;
+            continue;
+        }
+        NSUInteger lhsIndex = ((i+1) < [entries count]) ? i : i-1;
+        GTWAOFBTreePendingNode* lhs = entries[lhsIndex];
+        GTWAOFBTreePendingNode* rhs = entries[lhsIndex+1];
+        [lhs materializeFromAOF:ctx];
+        [rhs materializeFromAOF:ctx];
+        NSArray* merged = [self mergePendingNode:lhs withPendingNode:rhs updateContext:ctx];
+        [entries replaceObjectsInRange:NSMakeRange(lhsIndex, 2) withObjectsFromArray:merged];
+        i   = lhsIndex;
+    }
+}
+
+- (NSArray*) mergePendingNode:(GTWAOFBTreePendingNode*)lhs withPendingNode:(GTWAOFBTreePendingNode*)rhs updateContext:(GTWAOFUpdateContext*)ctx {
+    assert(lhs.type == rhs.type);
+    NSMutableArray* keys    = [lhs.keys mutableCopy];
+    NSMutableArray* values  = [lhs.values mutableCopy];
+    if (lhs.type == GTWAOFBTreeLeafNodeType) {
+        [keys addObjectsFromArray:rhs.keys];
+        [values addObjectsFromArray:rhs.values];
+        NSInteger max   = [GTWAOFBTreeNode maxLeafPageKeysForKeySize:self.keySize valueSize:self.valSize];
+        NSInteger count = [keys count];
+        if (count <= max) {
+            GTWAOFBTreePendingNode* node    = [GTWAOFBTreePendingNode pendingLeafNode];
+            node.keys   = keys;
+            node.values = values;
+            node.maxKey = rhs.maxKey;
+            return @[node];
+        }
+        NSInteger mid   = count/2;
+        GTWAOFBTreePendingNode* l   = [GTWAOFBTreePendingNode pendingLeafNode];
+        GTWAOFBTreePendingNode* r   = [GTWAOFBTreePendingNode pendingLeafNode];
+        l.keys      = [[keys subarrayWithRange:NSMakeRange(0, mid)] mutableCopy];
+        l.values    = [[values subarrayWithRange:NSMakeRange(0, mid)] mutableCopy];
+        r.keys      = [[keys subarrayWithRange:NSMakeRange(mid, count-mid)] mutableCopy];
+        r.values    = [[values subarrayWithRange:NSMakeRange(mid, count-mid)] mutableCopy];
+        l.maxKey    = [l.keys lastObject];
+        r.maxKey    = rhs.maxKey;
+        return @[l, r];
+    } else {
+        // the new separator between the two nodes is the max key of the left node's subtree
+        [keys addObject:lhs.maxKey];
+        [keys addObjectsFromArray:rhs.keys];
+        [values addObjectsFromArray:rhs.values];
+        NSInteger max   = [GTWAOFBTreeNode maxInternalPageKeysForKeySize:self.keySize];
+        if ([keys count] <= max) {
+            GTWAOFBTreePendingNode* node    = [GTWAOFBTreePendingNode pendingInternalNode];
+            node.keys   = keys;
+            node.values = values;
+            node.maxKey = rhs.maxKey;
+            return @[node];
+        }
+        NSInteger count = [values count];
+        NSInteger mid   = count/2;
+        GTWAOFBTreePendingNode* l   = [GTWAOFBTreePendingNode pendingInternalNode];
+        GTWAOFBTreePendingNode* r   = [GTWAOFBTreePendingNode pendingInternalNode];
+        l.keys      = [[keys subarrayWithRange:NSMakeRange(0, mid-1)] mutableCopy];
+        l.values    = [[values subarrayWithRange:NSMakeRange(0, mid)] mutableCopy];
+        r.keys      = [[keys subarrayWithRange:NSMakeRange(mid, count-mid-1)] mutableCopy];
+        r.values    = [[values subarrayWithRange:NSMakeRange(mid, count-mid)] mutableCopy];
+        // the key dropped between the two halves is the separator of the left node's last child
+        l.maxKey    = keys[mid-1];
+        r.maxKey    = rhs.maxKey;
+        return @[l, r];
+    }
+}
+
+- (GTWAOFBTreeNode*) writePendingNode:(GTWAOFBTreePendingNode*)pending root:(BOOL)root updateContext:(GTWAOFUpdateContext*)ctx {
+    if (pending.type == GTWAOFBTreeLeafNodeType) {
+        return [[GTWMutableAOFBTreeNode alloc] initLeafWithParent:nil isRoot:root keySize:self.keySize valueSize:self.valSize keys:pending.keys objects:pending.values updateContext:ctx];
+    } else {
+        return [[GTWMutableAOFBTreeNode alloc] initInternalWithParent:nil isRoot:root keySize:self.keySize valueSize:self.valSize keys:pending.keys pageIDs:pending.values updateContext:ctx];
+    }
+}
 
 @end
 
@@ -432,10 +432,14 @@
 }
 
 - (BOOL) verify {
-    return [self verifyHavingSeenRoot:NO];
+    return [self verifyHavingSeenRoot:NO subtreeMaxKey:NULL];
 }
 
-- (BOOL) verifyHavingSeenRoot:(BOOL)seenRoot {
+/**
+ Verifies the subtree rooted at this node. The separator a parent uses for a child is the largest key in the child's
+ subtree (for an internal child, the largest key of its last descendant leaf), which is returned in subtreeMax.
+ */
+- (BOOL) verifyHavingSeenRoot:(BOOL)seenRoot subtreeMaxKey:(NSData**)subtreeMax {
     NSLog(@"Verifying B+ Tree node %@ (on page %lld)", self, (long long)self.pageID);
     NSInteger count = [self nodeItemCount];
     NSArray* keys   = [self allKeys];
@@ -485,6 +489,8 @@
     }
     
     if (self.type == GTWAOFBTreeLeafNodeType) {
+        if (subtreeMax)
+            *subtreeMax = [keys lastObject];
     } else {
 //        NSLog(@"Internal node with children pointers: %@", _pageIDs);
         if ((1+count) != [_pageIDs count]) {
@@ -497,7 +503,8 @@
             NSNumber* number    = _pageIDs[i];
             NSInteger pageID    = [number integerValue];
             GTWAOFBTreeNode* child  = [GTWAOFBTreeNode nodeWithPageID:pageID parent:self fromAOF:_aof];
-            BOOL ok = [child verifyHavingSeenRoot:seenRoot];
+            NSData* childMax    = nil;
+            BOOL ok = [child verifyHavingSeenRoot:seenRoot subtreeMaxKey:&childMax];
             if (!ok)
                 return NO;
             if (i > 0) {
@@ -511,12 +518,13 @@
             
             if (i < count) {
                 NSData* key = _keys[i];
-                NSData* childMax    = [child maxKey];
                 if (![key isEqual:childMax]) {
                     NSLog(@"Child at page %lld has max key that differs from parent at page %lld key value\n- %@\n- %@", (long long)child.pageID, (long long)self.pageID, childMax, key);
                     return NO;
                 }
                 lastMaxKey  = key;
+            } else if (subtreeMax) {
+                *subtreeMax = childMax;
             }
         }
     }
@@ -822,7 +830,8 @@
     }
     
     ids[found]          = @(newNode.pageID);
-    if (found < [keys count]) {
+    if (found < [keys count] && newNode.type == GTWAOFBTreeLeafNodeType) {
+        // a rewritten internal node covers the same key range, so its separator is unchanged
         keys[found] = [newNode maxKey];
     }
     
@@ -857,6 +866,8 @@
         [is addIndex:i];
     }
     
+    // the new node covers the key ranges of both old children, so its separator is the second child's separator
+    NSData* separator   = ([is lastIndex] < keycount) ? keys[[is lastIndex]] : nil;
     if ([is lastIndex] >= keycount) {
         [keys removeObjectAtIndex:[is firstIndex]];
     } else {
@@ -866,8 +877,8 @@
     
     NSInteger i = [is firstIndex];
     [ids insertObject:@(newNode.pageID) atIndex:[is firstIndex]];
-    if (i < (keycount-1)) {
-        [keys insertObject:[newNode maxKey] atIndex:i];
+    if (separator) {
+        [keys insertObject:separator atIndex:i];
     }
     
     NSUInteger newChildCount    = [newNode subTreeItemCount];
@@ -1007,7 +1018,7 @@
     [ctx registerPageObject:lhs];
     [ctx registerPageObject:rhs];
     
-    return @[lhs, rhs];
+    return @[lhs, rhs, [lkeys lastObject]];
 }
 
 + (NSArray*) splitOrReplaceInternalNode:(GTWAOFBTreeNode*)node replacingChildID:(NSInteger)oldID withNewNodes:(NSArray*)newNodes updateContext:(GTWAOFUpdateContext*) ctx {
@@ -1025,18 +1036,18 @@
     
     GTWAOFBTreeNode* lhs    = newNodes[0];
     GTWAOFBTreeNode* rhs    = newNodes[1];
+    NSData* separator       = newNodes[2];
     
     if (i == ([children count]-1)) {
         // last child
         [children removeLastObject];
-        [keys addObject:[lhs maxKey]];
+        [keys addObject:separator];
         [children addObject:@(lhs.pageID)];
         [children addObject:@(rhs.pageID)];
     } else {
+        // the old child's separator remains the upper bound of the right node
         [children removeObjectAtIndex:i];
-        [keys removeObjectAtIndex:i];
-        [keys insertObject:[rhs maxKey] atIndex:i];
-        [keys insertObject:[lhs maxKey] atIndex:i];
+        [keys insertObject:separator atIndex:i];
         [children insertObject:@(rhs.pageID) atIndex:i];
         [children insertObject:@(lhs.pageID) atIndex:i];
     }
@@ -1070,11 +1081,11 @@
         GTWAOFBTreeNode* rnode    = [[GTWMutableAOFBTreeNode alloc] initWithPage:rpage parent:node.parent fromAOF:ctx];
         [pair addObject:lnode];
         [pair addObject:rnode];
-        for (GTWAOFBTreeNode* node in newNodes) {
-            if ([lkeys containsObject:node]) {
-                node.parent = lnode;
+        for (GTWAOFBTreeNode* n in @[lhs, rhs]) {
+            if ([lchildren containsObject:@(n.pageID)]) {
+                n.parent    = lnode;
             } else {
-                node.parent = rnode;
+                n.parent    = rnode;
             }
         }
     } else {
@@ -1096,6 +1107,10 @@
     for (id n in pair) {
         [ctx registerPageObject:n];
     }
+    if ([pair count] == 2) {
+        // the dropped middle key is the separator of the left node's last child, and so the max key of its subtree
+        [pair addObject:keys[mid-1]];
+    }
     return [pair copy];
 }
 
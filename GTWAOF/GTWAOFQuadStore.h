@@ -13,6 +13,7 @@
 #import "GTWAOFRawDictionary.h"
 #import "GTWAOFRawQuads.h"
 #import "GTWAOFBTree.h"
+#import "GTWAOFTermCache.h"
 #import "GTWTermIDGenerator.h"
 
 #define QUAD_STORE_COOKIE "QDST"
@@ -24,10 +25,12 @@
     NSMutableDictionary* _indexes;
     GTWAOFBTree* _btreeID2Term;
     GTWAOFBTree* _btreeTerm2ID;
-    NSCache* _termToRawDataCache;
-    NSCache* _termDataToIDCache;
-    NSMapTable* _IDToTermCache;
+    GTWAOFTermCache* _termCache;
     GTWTermIDGenerator* _gen;
+    NSMutableDictionary* _deltaKeys;
+    NSMutableDictionary* _deltaStates;
+    NSInteger _legacyGeneration;
+    NSInteger _legacyGenerationPageID;
 }
 
 @property (readwrite) BOOL verbose;
@@ -35,6 +38,7 @@
 @property (readonly) GTWAOFBTree* btreeID2Term;
 @property (readonly) GTWAOFBTree* btreeTerm2ID;
 @property (readwrite) GTWTermIDGenerator* gen;
+@property (readonly) GTWAOFTermCache* termCache;
 
 + (NSSet*) implementedProtocols;
 + (GTWAOFQuadStore*) quadStoreWithPageID:(NSInteger)pageID fromAOF:(id<GTWAOF>)aof;
@@ -46,19 +50,32 @@
 - (NSDictionary*) indexes;
 - (NSData*) hashData:(NSData*)data;
 - (GTWAOFQuadStore*) previousState;
+- (NSInteger) generation;
+- (NSDate*) lastModified;
+- (GTWAOFBTree*) versionIndex;
+- (GTWAOFQuadStore*) stateWithGeneration:(NSInteger)generation;
+- (GTWAOFQuadStore*) stateAsOfDate:(NSDate*)date;
+- (BOOL) enumerateDifferencesFromState:(GTWAOFQuadStore*)state usingBlock:(void (^)(id<GTWQuad> q, BOOL added))block error:(NSError *__autoreleasing*)error;
+- (BOOL) enumerateQuadsMatchingSubject: (id<GTWTerm>) s predicate: (id<GTWTerm>) p object: (id<GTWTerm>) o graph: (id<GTWTerm>) g identifierRanges: (NSDictionary*) ranges usingBlock: (void (^)(id<GTWQuad> q)) block error:(NSError *__autoreleasing*)error;
+- (NSUInteger) deltaCount;
 
 @end
 
 
 @interface GTWMutableAOFQuadStore : GTWAOFQuadStore<GTWMutableQuadStore> {
     NSMutableArray* _bulkQuads;
+    NSMutableArray* _bulkRemovedQuads;
     GTWMutableAOFRawDictionary* _mutableDict;
     GTWMutableAOFRawQuads* _mutableQuads;
     GTWMutableAOFBTree* _mutableBtreeID2Term;
     GTWMutableAOFBTree* _mutableBtreeTerm2ID;
+    NSLock* _writeLock;
+    dispatch_queue_t _mergeQueue;
+    BOOL _mergeScheduled;
 }
 
 @property BOOL bulkLoading;
+@property (readwrite) NSUInteger deltaMergeThreshold;
 @property (readwrite) id<GTWAOF,GTWMutableAOF> aof;
 @property (readwrite) GTWMutableAOFRawDictionary* mutableDict;
 @property (readwrite) GTWMutableAOFRawQuads* mutableQuads;
@@ -71,4 +88,11 @@
 - (void) beginBulkLoad;
 - (void) endBulkLoad;
 
+/**
+ Merges the delta into the indexes on the calling thread. Updates that grow the delta past deltaMergeThreshold
+ schedule the same merge on a background queue instead; waitForScheduledMerge blocks until such a merge has finished.
+ */
+- (BOOL) mergeDelta;
+- (void) waitForScheduledMerge;
+
 @end
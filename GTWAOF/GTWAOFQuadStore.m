@@ -16,10 +16,12 @@
 #import "NSData+GTWCompare.h"
 
 #define BULK_LOADING_BATCH_SIZE 1000
+#define DELTA_MERGE_THRESHOLD   1024
+#define VERSION_INDEX_INTERVAL  32
 
 #define TS_OFFSET       8
 #define PREV_OFFSET     16
-#define RSVD_OFFSET     24
+#define GEN_OFFSET      24
 #define DATA_OFFSET     32
 
 #define DEBUG           1
@@ -127,23 +129,42 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 - (instancetype) init {
     if (self = [super init]) {
         _indexes            = [NSMutableDictionary dictionary];
-        _termToRawDataCache = [[NSCache alloc] init];
-        _termDataToIDCache  = [[NSCache alloc] init];
-        _IDToTermCache      = [NSMapTable mapTableWithKeyOptions:NSMapTableWeakMemory valueOptions:NSMapTableWeakMemory];
         _gen                = [[GTWTermIDGenerator alloc] initWithNextAvailableCounter:1];
-        [_termToRawDataCache setCountLimit:128];
-        [_termDataToIDCache setCountLimit:128];
+        _legacyGenerationPageID = -1;
     }
     return self;
 }
 
+@synthesize aof = _aof;
+
+/**
+ Setting the AOF also attaches the store to the term cache shared by all quad store states read from that AOF (or,
+ for an update context, from the AOF being updated).
+ */
+- (void) setAof:(id<GTWAOF>)aof {
+    _aof        = aof;
+    _termCache  = [GTWAOFTermCache termCacheForAOF:aof];
+}
+
+/**
+ Returns the approximate number of bytes held by a term: the lengths of its value, language and datatype strings.
+ */
+static NSUInteger term_cost ( id<GTWTerm> term ) {
+    NSUInteger cost     = [[term value] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    if ([term respondsToSelector:@selector(language)])
+        cost    += [[term language] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    if ([term respondsToSelector:@selector(datatype)])
+        cost    += [[term datatype] lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    return cost;
+}
+
 - (NSData*) dataFromTerm: (id<GTWTerm>) t {
-    NSData* data    = [_termToRawDataCache objectForKey:t];
+    NSData* data    = [_termCache objectForKey:t kind:GTWAOFTermCacheDataForTerm];
     if (data)
         return data;
     data            = [NSData gtw_dataFromTerm:t];
 //    NSLog(@"got data for term: %@ -> %@", t, data);
-    [_termToRawDataCache setObject:data forKey:t];
+    [_termCache setObject:data forKey:t kind:GTWAOFTermCacheDataForTerm cost:term_cost(t) + [data length]];
     return data;
 }
 
@@ -212,11 +233,14 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
         } else if ([typeName isEqualToString:@"QUAD"]) {
 //            NSLog(@"Found Raw Quads index at page %llu", (unsigned long long)pageID);
             _quads   = [GTWAOFRawQuads rawQuadsWithPageID:pageID fromAOF:self.aof];
+        } else if ([typeName isEqualToString:@"VERS"]) {
+            // the version index is only read when looking up other versions (see -versionIndex)
         } else {
             NSLog(@"Unexpected index pointer for page %llu: %@", (unsigned long long)pageID, typeName);
             return NO;
         }
     }
+    [self _loadDelta];
     return YES;
 }
 
@@ -248,6 +272,264 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     return @(QUAD_STORE_COOKIE);
 }
 
+#pragma mark - Versions
+
+/**
+ Returns the page ID stored in the header page pointer entry of the given type, or -1 if there is no such entry.
+ */
+static NSInteger header_page_pointer ( NSData* data, const char* type ) {
+    const unsigned char* bytes  = data.bytes;
+    NSUInteger offset           = DATA_OFFSET;
+    while ((offset+16) <= [data length]) {
+        if (!memcmp(bytes+offset, "\0\0\0\0", 4))
+            break;
+        if (!memcmp(bytes+offset, type, 4))
+            return (NSInteger)[data gtw_integerFromBigLongLongRange:NSMakeRange(offset+8, 8)];
+        offset  += 16;
+    }
+    return -1;
+}
+
+static NSInteger header_previous_page_id ( NSData* data ) {
+    return (NSInteger)[data gtw_integerFromBigLongLongRange:NSMakeRange(PREV_OFFSET, 8)];
+}
+
+static uint64_t header_timestamp ( NSData* data ) {
+    return (uint64_t)[data gtw_integerFromBigLongLongRange:NSMakeRange(TS_OFFSET, 8)];
+}
+
+/**
+ Version index keys are the 8-byte generation followed by the 8-byte commit timestamp (both big-endian). Header
+ timestamps never decrease along the previous-header chain, so the keys are ordered by both.
+ */
+static NSData* version_key ( uint64_t generation, uint64_t ts ) {
+    NSMutableData* key  = [[NSData gtw_bigLongLongDataWithInteger:generation] mutableCopy];
+    [key appendData:[NSData gtw_bigLongLongDataWithInteger:ts]];
+    return key;
+}
+
+/**
+ Returns the generation following the last one in the version index (0 for an empty index). Headers with this or a
+ later generation are only linked by the previous-header chain.
+ */
+static int64_t version_index_next_generation ( GTWAOFBTree* versions ) {
+    NSArray* pair   = [versions lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+        return YES;
+    }];
+    if (!pair)
+        return 0;
+    return (int64_t)[pair[0] gtw_integerFromBigLongLongRange:NSMakeRange(0, 8)] + 1;
+}
+
+/**
+ Returns the version number of this quad store state: the number of header pages before it in the previous-header chain.
+ */
+- (NSInteger) generation {
+    NSData* data    = _head.data;
+    if (header_page_pointer(data, "VERS") >= 0 || self.previousPageID < 0) {
+        return (NSInteger)[data gtw_integerFromBigLongLongRange:NSMakeRange(GEN_OFFSET, 8)];
+    }
+    
+    // headers written before the version index was introduced don't record their generation, so it is counted (once
+    // per state) by walking the previous-header chain
+    @synchronized(self) {
+        if (_legacyGenerationPageID != self.pageID) {
+            NSInteger generation    = 0;
+            for (NSInteger pid = self.previousPageID; pid >= 0; pid = header_previous_page_id([self.aof readPage:pid].data)) {
+                generation++;
+            }
+            _legacyGeneration       = generation;
+            _legacyGenerationPageID = self.pageID;
+        }
+        return _legacyGeneration;
+    }
+}
+
+/**
+ Returns the B+ tree mapping the version keys of earlier states to their header page IDs, or nil if the header
+ predates the version index (or this is the first state). The index is updated when the delta is merged, when a bulk
+ load ends, and otherwise once every VERSION_INDEX_INTERVAL headers, so fewer than VERSION_INDEX_INTERVAL states are
+ missing from it; those are found on the previous-header chain instead.
+ */
+- (GTWAOFBTree*) versionIndex {
+    NSInteger pageID    = header_page_pointer(_head.data, "VERS");
+    if (pageID < 0)
+        return nil;
+    return [[GTWAOFBTree alloc] initWithRootPageID:pageID fromAOF:self.aof];
+}
+
+- (NSInteger) headerPageIDForGeneration:(NSInteger)generation {
+    NSInteger current   = [self generation];
+    if (generation == current)
+        return self.pageID;
+    if (generation < 0 || generation > current)
+        return -1;
+    
+    GTWAOFBTree* versions   = [self versionIndex];
+    if (versions) {
+        NSData* lower           = version_key(generation, 0);
+        NSMutableData* upper    = [[NSData gtw_bigLongLongDataWithInteger:generation] mutableCopy];
+        [upper appendData:[NSData gtw_bigLongLongDataWithInteger:UINT64_MAX]];
+        __block NSInteger pageID    = -1;
+        [versions enumerateKeysFrom:lower to:upper usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+            pageID  = (NSInteger)[obj gtw_integerFromBigLongLong];
+            *stop   = YES;
+        }];
+        if (pageID >= 0)
+            return pageID;
+        // states written since the version index was last updated are at most VERSION_INDEX_INTERVAL-1 headers back
+    }
+    
+    NSInteger pageID    = self.pageID;
+    for (NSInteger i = current; i > generation && pageID >= 0; i--) {
+        pageID  = header_previous_page_id([self.aof readPage:pageID].data);
+    }
+    return pageID;
+}
+
+/**
+ Returns the state of the quad store with the given generation, found with a single version index lookup (or, for
+ the few states written since the index was last updated, by walking the previous-header chain).
+ */
+- (GTWAOFQuadStore*) stateWithGeneration:(NSInteger)generation {
+    NSInteger pageID    = [self headerPageIDForGeneration:generation];
+    if (pageID < 0)
+        return nil;
+    if (pageID == self.pageID)
+        return self;
+    return [GTWAOFQuadStore quadStoreWithPageID:pageID fromAOF:self.aof];
+}
+
+/**
+ Returns the latest state of the quad store that was committed at or before the given date, or nil if the quad store
+ was created after it.
+ */
+- (GTWAOFQuadStore*) stateAsOfDate:(NSDate*)date {
+    NSTimeInterval interval = [date timeIntervalSince1970];
+    if (interval < 0)
+        return nil;
+    uint64_t ts     = (uint64_t) interval;
+    if (header_timestamp(_head.data) <= ts)
+        return self;
+    
+    GTWAOFBTree* versions   = [self versionIndex];
+    if (versions) {
+        // states written since the version index was last updated are checked first, newest to oldest
+        int64_t next    = version_index_next_generation(versions);
+        int64_t gen     = [self generation] - 1;
+        for (NSInteger pid = self.previousPageID; pid >= 0 && gen >= next; gen--) {
+            GTWAOFPage* page    = [self.aof readPage:pid];
+            if (header_timestamp(page.data) <= ts)
+                return [GTWAOFQuadStore quadStoreWithPageID:pid fromAOF:self.aof];
+            pid = header_previous_page_id(page.data);
+        }
+        NSArray* pair   = [versions lastKeyAndObjectPassingTest:^BOOL(NSData *key) {
+            return ((uint64_t)[key gtw_integerFromBigLongLongRange:NSMakeRange(8, 8)] <= ts);
+        }];
+        if (!pair)
+            return nil;
+        return [GTWAOFQuadStore quadStoreWithPageID:(NSInteger)[pair[1] gtw_integerFromBigLongLong] fromAOF:self.aof];
+    }
+    
+    // headers written before the version index was introduced can only be found on the chain
+    for (NSInteger pid = self.previousPageID; pid >= 0; ) {
+        GTWAOFPage* page    = [self.aof readPage:pid];
+        if (header_timestamp(page.data) <= ts)
+            return [GTWAOFQuadStore quadStoreWithPageID:pid fromAOF:self.aof];
+        pid = header_previous_page_id(page.data);
+    }
+    return nil;
+}
+
+/**
+ Returns the union of two sorted arrays of keys, in sorted order.
+ */
+static NSArray* merged_sorted_keys ( NSArray* a, NSArray* b ) {
+    NSUInteger acount       = [a count];
+    NSUInteger bcount       = [b count];
+    NSMutableArray* keys    = [NSMutableArray arrayWithCapacity:acount+bcount];
+    NSUInteger i = 0, j = 0;
+    while (i < acount || j < bcount) {
+        NSComparisonResult r;
+        if (i < acount && j < bcount) {
+            r   = [a[i] gtw_compare:b[j]];
+        } else {
+            r   = (i < acount) ? NSOrderedAscending : NSOrderedDescending;
+        }
+        if (r == NSOrderedAscending) {
+            [keys addObject:a[i++]];
+        } else {
+            if (r == NSOrderedSame)
+                i++;
+            [keys addObject:b[j++]];
+        }
+    }
+    return keys;
+}
+
+/**
+ Enumerates the quads that were added to (added == YES) or removed from the quad store between the given state and
+ this one, in SPOG order. The SPOG indexes of the two states are compared with a structural B+ tree diff that skips
+ shared pages, and the (bounded) deltas of both states are merged with the keys the diff produces as it proceeds, so
+ that each candidate key is checked once and differences are reported as soon as they are found.
+ */
+- (BOOL) enumerateDifferencesFromState:(GTWAOFQuadStore*)state usingBlock:(void (^)(id<GTWQuad> q, BOOL added))block error:(NSError *__autoreleasing*)error {
+    GTWAOFBTree* oldIndex;
+    GTWAOFBTree* newIndex;
+    NSArray* oldDelta;
+    NSArray* newDelta;
+    @synchronized(state) {
+        oldIndex    = state->_indexes[@"SPOG"];
+        oldDelta    = [state->_deltaKeys[@"SPOG"] copy];
+    }
+    @synchronized(self) {
+        newIndex    = _indexes[@"SPOG"];
+        newDelta    = [_deltaKeys[@"SPOG"] copy];
+    }
+    if (!(oldIndex && newIndex)) {
+        NSLog(@"Cannot compare QuadStore states without SPOG indexes");
+        return NO;
+    }
+    
+    NSArray* deltaKeys          = merged_sorted_keys(oldDelta, newDelta);
+    NSUInteger deltaCount       = [deltaKeys count];
+    __block NSUInteger j        = 0;
+    __block NSData* lastKey     = nil;
+    BOOL (^checkKey)(NSData*)   = ^BOOL(NSData* key) {
+        // a key can be both in a delta and in the index diff
+        if (lastKey && [lastKey isEqual:key])
+            return YES;
+        lastKey = key;
+        @autoreleasepool {
+            BOOL wasPresent = [state containsQuadKey:key];
+            BOOL isPresent  = [self containsQuadKey:key];
+            if (wasPresent == isPresent)
+                return YES;
+            GTWAOFQuadStore* store  = isPresent ? self : state;
+            id<GTWQuad> q           = [store quadFromKeyData:key keyOrder:@"SPOG"];
+            if (!q)
+                return NO;
+            block(q, isPresent);
+        }
+        return YES;
+    };
+    
+    __block BOOL ok = YES;
+    [newIndex enumerateDifferencesFromBTree:oldIndex usingBlock:^(NSData *key, NSData *oldObj, NSData *newObj, BOOL *stop) {
+        while (ok && j < deltaCount && [deltaKeys[j] gtw_compare:key] != NSOrderedDescending) {
+            ok  = checkKey(deltaKeys[j++]);
+        }
+        if (ok)
+            ok  = checkKey(key);
+        if (!ok)
+            *stop   = YES;
+    }];
+    while (ok && j < deltaCount) {
+        ok  = checkKey(deltaKeys[j++]);
+    }
+    return ok;
+}
+
 - (NSDictionary*) indexes {
     return [_indexes copy];
 }
@@ -256,8 +538,151 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     return _head.pageID;
 }
 
+#pragma mark - Delta
+
+/**
+ Returns the 32-byte SPOG-ordered quad key permuted into the given key order.
+ */
+static NSData* quad_key_in_order ( NSData* spogKey, NSString* keyOrder ) {
+    NSMutableData* key          = [NSMutableData dataWithLength:32];
+    const unsigned char* bytes  = spogKey.bytes;
+    unsigned char* buf          = key.mutableBytes;
+    for (NSInteger i = 0; i < 4; i++) {
+        unichar pos     = [keyOrder characterAtIndex:i];
+        NSInteger src   = (pos == 'S') ? 0 : (pos == 'P') ? 1 : (pos == 'O') ? 2 : 3;
+        memcpy(buf + (8*i), bytes + (8*src), 8);
+    }
+    return key;
+}
+
+/**
+ Rebuilds the in-memory mirror of the delta (the raw quads pages that have not yet been merged into the indexes)
+ by replaying the quads pages from oldest to newest. For each key order, _deltaKeys holds a sorted array of quad keys
+ and _deltaStates maps each key to @YES (added) or @NO (removed).
+ */
+- (void) _loadDelta {
+    @synchronized(self) {
+        _deltaKeys      = [NSMutableDictionary dictionary];
+        _deltaStates    = [NSMutableDictionary dictionary];
+        for (NSString* keyOrder in _indexes) {
+            _deltaKeys[keyOrder]    = [NSMutableArray array];
+            _deltaStates[keyOrder]  = [NSMutableDictionary dictionary];
+        }
+        
+        NSMutableArray* pages   = [NSMutableArray array];
+        for (GTWAOFRawQuads* q = _quads; q; q = [q previousPage]) {
+            if ([q count])
+                [pages addObject:q];
+        }
+        for (GTWAOFRawQuads* q in [pages reverseObjectEnumerator]) {
+            BOOL added  = ![q isRemovedQuadsPage];
+            for (NSData* key in [q allObjects]) {
+                [self _setDeltaState:added forQuadKey:key];
+            }
+        }
+    }
+}
+
+/**
+ Caller must be synchronized on self.
+ */
+- (void) _setDeltaState:(BOOL)added forQuadKey:(NSData*)spogKey {
+    for (NSString* keyOrder in _deltaStates) {
+        NSData* key                     = quad_key_in_order(spogKey, keyOrder);
+        NSMutableDictionary* states     = _deltaStates[keyOrder];
+        if (!states[key]) {
+            NSMutableArray* keys    = _deltaKeys[keyOrder];
+            NSUInteger i            = [keys indexOfObject:key inSortedRange:NSMakeRange(0, [keys count]) options:NSBinarySearchingInsertionIndex usingComparator:^NSComparisonResult(NSData* a, NSData* b) {
+                return [a gtw_compare:b];
+            }];
+            [keys insertObject:key atIndex:i];
+        }
+        states[key]     = @(added);
+    }
+}
+
+/**
+ Returns the number of quads added or removed in the delta that have not yet been merged into the indexes.
+ */
+- (NSUInteger) deltaCount {
+    @synchronized(self) {
+        return [_deltaStates[@"SPOG"] count];
+    }
+}
+
+/**
+ Returns YES if the quad with the given SPOG key is in the store, taking the delta into account.
+ */
+- (BOOL) containsQuadKey:(NSData*)spogKey {
+    GTWAOFBTree* spog;
+    @synchronized(self) {
+        NSNumber* state = _deltaStates[@"SPOG"][spogKey];
+        if (state)
+            return [state boolValue];
+        spog    = _indexes[@"SPOG"];
+    }
+    return ([spog objectForKey:spogKey] != nil);
+}
+
+/**
+ Enumerates the keys of the index with the given key order between lower and upper (inclusive; nil for an open bound),
+ merged with the delta: keys removed in the delta are skipped and keys added in the delta are enumerated in key order.
+ */
+- (void) enumerateKeysForKeyOrder:(NSString*)keyOrder from:(NSData*)lower to:(NSData*)upper usingBlock:(void (^)(NSData* key, BOOL *stop))block {
+    NSComparator cmp    = ^NSComparisonResult(NSData* a, NSData* b) {
+        return [a gtw_compare:b];
+    };
+    GTWAOFBTree* index;
+    NSArray* keys;
+    NSArray* states;
+    @synchronized(self) {
+        index               = _indexes[keyOrder];
+        NSArray* sorted     = _deltaKeys[keyOrder];
+        NSRange all         = NSMakeRange(0, [sorted count]);
+        NSUInteger start    = lower ? [sorted indexOfObject:lower inSortedRange:all options:NSBinarySearchingInsertionIndex|NSBinarySearchingFirstEqual usingComparator:cmp] : 0;
+        NSUInteger end      = upper ? [sorted indexOfObject:upper inSortedRange:all options:NSBinarySearchingInsertionIndex|NSBinarySearchingLastEqual usingComparator:cmp] : all.length;
+        keys                = (end > start) ? [sorted subarrayWithRange:NSMakeRange(start, end-start)] : @[];
+        states              = [_deltaStates[keyOrder] objectsForKeys:keys notFoundMarker:@NO];
+    }
+    
+    NSUInteger count    = [keys count];
+    __block NSUInteger j    = 0;
+    __block BOOL stop       = NO;
+    [index enumerateKeysFrom:lower to:upper usingBlock:^(NSData *key, NSData *obj, BOOL *treeStop) {
+        while (j < count) {
+            NSData* deltaKey        = keys[j];
+            NSComparisonResult c    = [deltaKey gtw_compare:key];
+            if (c == NSOrderedDescending)
+                break;
+            BOOL added  = [states[j] boolValue];
+            j++;
+            if (c == NSOrderedSame) {
+                if (!added)
+                    return;
+                break;
+            }
+            if (added) {
+                block(deltaKey, &stop);
+                if (stop) {
+                    *treeStop   = YES;
+                    return;
+                }
+            }
+        }
+        block(key, &stop);
+        if (stop)
+            *treeStop   = YES;
+    }];
+    for (; !stop && j < count; j++) {
+        if ([states[j] boolValue])
+            block(keys[j], &stop);
+    }
+}
+
+#pragma mark -
+
 - (NSData*) _IDDataFromTermData:(NSData*)termData {
-    NSData* ident   = [_termDataToIDCache objectForKey:termData];
+    NSData* ident   = [_termCache objectForKey:termData kind:GTWAOFTermCacheIDForTermData];
     if (ident)
         return ident;
     
@@ -266,7 +691,7 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     //    NSLog(@"got data for term: %@ -> %@", term, data);
     
     if (ident)
-        [_termDataToIDCache setObject:ident forKey:termData];
+        [_termCache setObject:ident forKey:termData kind:GTWAOFTermCacheIDForTermData cost:[termData length] + [ident length]];
     return ident;
 }
 
@@ -284,14 +709,14 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 
 - (id<GTWTerm>) _termFromIDData:(NSData*)idData {
     id<GTWTerm> term;
-    term    = [_IDToTermCache objectForKey:idData];
+    term    = [_termCache objectForKey:idData kind:GTWAOFTermCacheTermForID];
     if (term) {
         return term;
     }
     
     term    = [_gen termForIdentifier:idData];
     if (term) {
-        [_IDToTermCache setObject:term forKey:idData];
+        [_termCache setObject:term forKey:idData kind:GTWAOFTermCacheTermForID cost:[idData length] + term_cost(term)];
         return term;
     }
     
@@ -314,7 +739,7 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     if (!term)
         return nil;
     
-    [_IDToTermCache setObject:term forKey:idData];
+    [_termCache setObject:term forKey:idData kind:GTWAOFTermCacheTermForID cost:[idData length] + term_cost(term)];
     return term;
 }
 
@@ -514,6 +939,74 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     return maxKeyOrder;
 }
 
+/**
+ Like bestKeyOrderMatchingSubject:predicate:object:graph:, but prefers (among the key orders with the longest bound prefix)
+ one whose next key position has an identifier range restriction, so that the range can be used to bound the index scan.
+ */
+- (NSString*) bestKeyOrderMatchingSubject: (id<GTWTerm>) s predicate: (id<GTWTerm>) p object: (id<GTWTerm>) o graph: (id<GTWTerm>) g identifierRanges: (NSDictionary*) ranges {
+    NSString* bestKeyOrder  = [self bestKeyOrderMatchingSubject:s predicate:p object:o graph:g];
+    if (![ranges count])
+        return bestKeyOrder;
+    
+    NSDictionary* terms     = @{ @"S": ((id)s ?: [NSNull null]), @"P": ((id)p ?: [NSNull null]), @"O": ((id)o ?: [NSNull null]), @"G": ((id)g ?: [NSNull null]) };
+    NSInteger (^score)(NSString*) = ^NSInteger(NSString* keyOrder) {
+        NSInteger length    = 0;
+        for (NSInteger i = 0; i < [keyOrder length]; i++) {
+            NSString* pos   = [keyOrder substringWithRange:NSMakeRange(i, 1)];
+            id term         = terms[pos];
+            if (term != [NSNull null] && !([term isKindOfClass:[GTWVariable class]])) {
+                length  += 2;
+            } else {
+                if ([ranges[pos] count])
+                    length++;
+                break;
+            }
+        }
+        return length;
+    };
+    
+    NSInteger maxScore  = score(bestKeyOrder);
+    for (NSString* keyOrder in _indexes) {
+        NSInteger sc    = score(keyOrder);
+        if (sc > maxScore) {
+            maxScore        = sc;
+            bestKeyOrder    = keyOrder;
+        }
+    }
+    return bestKeyOrder;
+}
+
+/**
+ Sorts and coalesces an array of inclusive @[lower, upper] identifier ranges so that each key is scanned at most once.
+ */
+static NSArray* merged_identifier_ranges ( NSArray* ranges ) {
+    NSArray* sorted = [ranges sortedArrayUsingComparator:^NSComparisonResult(NSArray* a, NSArray* b) {
+        return [a[0] gtw_compare:b[0]];
+    }];
+    NSMutableArray* merged  = [NSMutableArray array];
+    for (NSArray* range in sorted) {
+        NSArray* last   = [merged lastObject];
+        if (last && [range[0] gtw_compare:last[1]] != NSOrderedDescending) {
+            if ([range[1] gtw_compare:last[1]] == NSOrderedDescending) {
+                [merged replaceObjectAtIndex:([merged count]-1) withObject:@[last[0], range[1]]];
+            }
+        } else {
+            [merged addObject:range];
+        }
+    }
+    return merged;
+}
+
+static BOOL identifier_in_ranges ( const unsigned char* ident, NSArray* ranges ) {
+    for (NSArray* range in ranges) {
+        NSData* lower   = range[0];
+        NSData* upper   = range[1];
+        if (memcmp(ident, lower.bytes, 8) >= 0 && memcmp(ident, upper.bytes, 8) <= 0)
+            return YES;
+    }
+    return NO;
+}
+
 #pragma mark - Quad Store Methods
 
 - (NSArray*) getGraphsWithError:(NSError *__autoreleasing*)error {
@@ -538,8 +1031,8 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     };
     
     NSMutableSet* graphs    = [NSMutableSet set];
-    GTWAOFBTree* spog   = _indexes[@"SPOG"];    // TODO: should enumerate with an index whose key order is {G}
-    [spog enumerateKeysAndObjectsUsingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
+    // TODO: should enumerate with an index whose key order is {G}
+    [self enumerateKeysForKeyOrder:@"SPOG" from:nil to:nil usingBlock:^(NSData *key, BOOL *stop) {
         NSData* data        = key;
         id<GTWTerm> g       = dataToGraph(data);
         if (g) {
@@ -548,18 +1041,6 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
             *stop   = YES;
         }
     }];
-    if (NO) {
-        // if the raw quads pages are used to store quads that aren't in the b+ tree, this block should be enabled
-        [_quads enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
-            NSData* data        = obj;
-            id<GTWTerm> g       = dataToGraph(data);
-            if (g) {
-                [graphs addObject:g];
-            } else {
-                *stop   = YES;
-            }
-        }];
-    }
     for (id<GTWTerm> g in graphs) {
         block(g);
     }
@@ -577,6 +1058,16 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 }
 
 - (BOOL) enumerateQuadsMatchingSubject: (id<GTWTerm>) s predicate: (id<GTWTerm>) p object: (id<GTWTerm>) o graph: (id<GTWTerm>) g usingBlock: (void (^)(id<GTWQuad> q)) block error:(NSError *__autoreleasing*)error {
+    return [self enumerateQuadsMatchingSubject:s predicate:p object:o graph:g identifierRanges:nil usingBlock:block error:error];
+}
+
+/**
+ The ranges dictionary maps quad positions (@"S", @"P", @"O", @"G") to arrays of inclusive @[lowerID, upperID] term ID ranges
+ (as returned by the GTWTermIDGenerator identifierRanges... methods). Only quads whose term IDs fall within one of the ranges for each
+ restricted position are enumerated. If the chosen index's next key position (after the bound prefix) is restricted, only the
+ matching key ranges of the index are scanned.
+ */
+- (BOOL) enumerateQuadsMatchingSubject: (id<GTWTerm>) s predicate: (id<GTWTerm>) p object: (id<GTWTerm>) o graph: (id<GTWTerm>) g identifierRanges: (NSDictionary*) ranges usingBlock: (void (^)(id<GTWQuad> q)) block error:(NSError *__autoreleasing*)error {
     if ([s isKindOfClass:[GTWVariable class]])
         s   = nil;
     if ([p isKindOfClass:[GTWVariable class]])
@@ -608,70 +1099,110 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     };
     
     id<GTWQuad> (^dataToQuad)(NSData*, NSString*) = ^id<GTWQuad>(NSData* data, NSString* keyOrder) {
-        NSInteger soffset, poffset, ooffset, goffset;
-        for (NSInteger i = 0; i < [keyOrder length]; i++) {
-            unichar pos     = [keyOrder characterAtIndex:i];
-            NSInteger offset    = 8*i;
-            if (pos == 'S') {
-                soffset = offset;
-            } else if (pos == 'P') {
-                poffset = offset;
-            } else if (pos == 'O') {
-                ooffset = offset;
-            } else if (pos == 'G') {
-                goffset = offset;
-            }
-        }
-        
-        NSData* skey        = [data subdataWithRange:NSMakeRange(soffset, 8)];
-        NSData* pkey        = [data subdataWithRange:NSMakeRange(poffset, 8)];
-        NSData* okey        = [data subdataWithRange:NSMakeRange(ooffset, 8)];
-        NSData* gkey        = [data subdataWithRange:NSMakeRange(goffset, 8)];
-        
-        id<GTWTerm> s       = [self _termFromIDData:skey];
-        id<GTWTerm> p       = [self _termFromIDData:pkey];
-        id<GTWTerm> o       = [self _termFromIDData:okey];
-        id<GTWTerm> g       = [self _termFromIDData:gkey];
-        if (!s || !p || !o || !g) {
-            NSLog(@"bad quad decoded from AOF quadstore");
-            return nil;
-        }
-        GTWQuad* q          = [[GTWQuad alloc] initWithSubject:s predicate:p object:o graph:g];
-        return q;
+        return [self quadFromKeyData:data keyOrder:keyOrder];
     };
     
-    NSString* bestKeyOrder  = [self bestKeyOrderMatchingSubject:s predicate:p object:o graph:g];
+    NSString* bestKeyOrder  = [self bestKeyOrderMatchingSubject:s predicate:p object:o graph:g identifierRanges:ranges];
 //    NSLog(@"best key order: %@", bestKeyOrder);
-    GTWAOFBTree* index  = _indexes[bestKeyOrder];
     NSData* bestPrefix  = [self prefixForKeyOrder:bestKeyOrder matchingSubject:s predicate:p object:o graph:g];
 //    NSLog(@"index prefix: %@", bestPrefix);
     
-    @autoreleasepool {
-        [index enumerateKeysAndObjectsMatchingPrefix:bestPrefix usingBlock:^(NSData *key, NSData *obj, BOOL *stop) {
-            NSData* data        = key;
-            id<GTWQuad> q       = dataToQuad(data, bestKeyOrder);
-            if (q) {
-                testQuad(q);
-            } else {
-                *stop   = YES;
-            }
-        }];
+    // key offsets of the range-restricted positions, checked against the raw key before any terms are decoded
+    NSMutableDictionary* rangeOffsets   = [NSMutableDictionary dictionary];
+    for (NSInteger i = 0; i < [bestKeyOrder length]; i++) {
+        NSString* pos   = [bestKeyOrder substringWithRange:NSMakeRange(i, 1)];
+        if ([ranges[pos] count]) {
+            rangeOffsets[@(8*i)]    = ranges[pos];
+        }
     }
-    if (NO) {
-        // if the raw quads pages are used to store quads that aren't in the b+ tree, this block should be enabled
-        [_quads enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
-            NSData* data        = obj;
-            id<GTWQuad> q       = dataToQuad(data, bestKeyOrder);
-            if (q) {
-                testQuad(q);
-            } else {
-                *stop   = YES;
+    
+    void (^handleKey)(NSData*, BOOL*) = ^(NSData *key, BOOL *stop) {
+        const unsigned char* bytes  = key.bytes;
+        for (NSNumber* offset in rangeOffsets) {
+            if (!identifier_in_ranges(bytes + [offset integerValue], rangeOffsets[offset]))
+                return;
+        }
+        NSData* data        = key;
+        id<GTWQuad> q       = dataToQuad(data, bestKeyOrder);
+        if (q) {
+            testQuad(q);
+        } else {
+            *stop   = YES;
+        }
+    };
+    
+    NSUInteger nextPosition = [bestPrefix length] / 8;
+    NSArray* scanRanges     = nil;
+    if (nextPosition < [bestKeyOrder length]) {
+        scanRanges  = ranges[[bestKeyOrder substringWithRange:NSMakeRange(nextPosition, 1)]];
+    }
+    
+    GTWAOFBTree* index;
+    @synchronized(self) {
+        index   = _indexes[bestKeyOrder];
+    }
+    @autoreleasepool {
+        NSInteger keySize   = [index keySize];
+        if ([scanRanges count]) {
+            NSInteger padding   = keySize - [bestPrefix length] - 8;
+            NSMutableData* ones = [NSMutableData dataWithLength:padding];
+            memset([ones mutableBytes], 0xFF, padding);
+            for (NSArray* range in merged_identifier_ranges(scanRanges)) {
+                NSMutableData* lower    = [bestPrefix mutableCopy];
+                [lower appendData:range[0]];
+                [lower setLength:keySize];
+                NSMutableData* upper    = [bestPrefix mutableCopy];
+                [upper appendData:range[1]];
+                [upper appendData:ones];
+                [self enumerateKeysForKeyOrder:bestKeyOrder from:lower to:upper usingBlock:handleKey];
             }
-        }];
+        } else if ([bestPrefix length]) {
+            NSMutableData* lower    = [bestPrefix mutableCopy];
+            [lower setLength:keySize];
+            NSMutableData* upper    = [bestPrefix mutableCopy];
+            [upper setLength:keySize];
+            memset((unsigned char*)[upper mutableBytes] + [bestPrefix length], 0xFF, keySize - [bestPrefix length]);
+            [self enumerateKeysForKeyOrder:bestKeyOrder from:lower to:upper usingBlock:handleKey];
+        } else {
+            [self enumerateKeysForKeyOrder:bestKeyOrder from:nil to:nil usingBlock:handleKey];
+        }
     }
     return YES;
 }
 
+- (id<GTWQuad>) quadFromKeyData:(NSData*)data keyOrder:(NSString*)keyOrder {
+    NSInteger soffset, poffset, ooffset, goffset;
+    for (NSInteger i = 0; i < [keyOrder length]; i++) {
+        unichar pos     = [keyOrder characterAtIndex:i];
+        NSInteger offset    = 8*i;
+        if (pos == 'S') {
+            soffset = offset;
+        } else if (pos == 'P') {
+            poffset = offset;
+        } else if (pos == 'O') {
+            ooffset = offset;
+        } else if (pos == 'G') {
+            goffset = offset;
+        }
+    }
+    
+    NSData* skey        = [data subdataWithRange:NSMakeRange(soffset, 8)];
+    NSData* pkey        = [data subdataWithRange:NSMakeRange(poffset, 8)];
+    NSData* okey        = [data subdataWithRange:NSMakeRange(ooffset, 8)];
+    NSData* gkey        = [data subdataWithRange:NSMakeRange(goffset, 8)];
+    
+    id<GTWTerm> s       = [self _termFromIDData:skey];
+    id<GTWTerm> p       = [self _termFromIDData:pkey];
+    id<GTWTerm> o       = [self _termFromIDData:okey];
+    id<GTWTerm> g       = [self _termFromIDData:gkey];
+    if (!s || !p || !o || !g) {
+        NSLog(@"bad quad decoded from AOF quadstore");
+        return nil;
+    }
+    GTWQuad* q          = [[GTWQuad alloc] initWithSubject:s predicate:p object:o graph:g];
+    return q;
+}
+
 - (BOOL) enumerateQuadsWithBlock: (void (^)(id<GTWQuad> q)) block error:(NSError *__autoreleasing*)error {
     return [self enumerateQuadsMatchingSubject:nil predicate:nil object:nil graph:nil usingBlock:block error:error];
 }
@@ -683,10 +1214,15 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
   
     GTWAOFBTreeNode* lca    = [index lcaNodeForKeysWithPrefix:bestPrefix];
 //    NSLog(@"%@ LCA: %@", bestKeyOrder, lca);
-    return [lca lastModified];
+    NSDate* date            = [lca lastModified];
     
-    // this is rather coarse-grained, but we don't expect to be using the raw-quads a lot
-    //    return [_quads lastModified];
+    // this is rather coarse-grained, but the delta is bounded by the merge threshold
+    if ([self deltaCount]) {
+        NSDate* deltaDate   = [_quads lastModified];
+        if (!date || [deltaDate compare:date] == NSOrderedDescending)
+            date    = deltaDate;
+    }
+    return date;
 }
 
 #pragma mark -
@@ -713,6 +1249,15 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     return [self initWithFilename:dictionary[@"file"]];
 }
 
+- (instancetype) init {
+    if (self = [super init]) {
+        _writeLock              = [[NSLock alloc] init];
+        _mergeQueue             = dispatch_queue_create("us.kasei.sparql.aof.quadstore.merge", DISPATCH_QUEUE_SERIAL);
+        _deltaMergeThreshold    = DELTA_MERGE_THRESHOLD;
+    }
+    return self;
+}
+
 - (GTWMutableAOFQuadStore*) initWithFilename: (NSString*) filename {
     if (self = [self init]) {
         self.aof    = [[GTWAOFDirectFile alloc] initWithFilename:filename flags:O_RDWR|O_SHLOCK];
@@ -748,6 +1293,7 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
                 return YES;
             }];
             _head   = [self.aof readPage:headPageID];
+            [self _loadDelta];
         } else {
             _head   = [self.aof readPage:headerPageID];
             BOOL ok = [self _loadPointers];
@@ -839,11 +1385,14 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
         } else if ([typeName isEqualToString:@"QUAD"]) {
 //            NSLog(@"Found Raw Quads index at page %llu", (unsigned long long)pageID);
             self.mutableQuads   = [[GTWMutableAOFRawQuads alloc] initWithPageID:pageID fromAOF:self.aof];
+        } else if ([typeName isEqualToString:@"VERS"]) {
+            // the version index is only read when looking up other versions (see -versionIndex)
         } else {
             NSLog(@"Unexpected index pointer for page %llu: %@", (unsigned long long)pageID, typeName);
             return NO;
         }
     }
+    [self _loadDelta];
     return YES;
 }
 
@@ -871,13 +1420,33 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
         _indexes[@"POGS"]   = indexes[@"POGS"];
         _btreeID2Term       = i2t;
         _btreeTerm2ID       = t2i;
+        // the new state isn't attached to an AOF until the update commits, but it shares the cache of the AOF being updated
+        _termCache          = [GTWAOFTermCache termCacheForAOF:[ctx aof]];
+        [self _loadDelta];
     }
     return self;
 }
 
 - (NSInteger) writeNewQuadStoreHeaderPageWithPreviousPageID:(NSInteger)prevID rawDictionary:(GTWAOFRawDictionary*)dict rawQuads:(GTWAOFRawQuads*)quads idToTerm:(GTWAOFBTree*)i2t termToID:(GTWAOFBTree*)t2i btreeIndexes:(NSDictionary*)indexes updateContext:(GTWAOFUpdateContext*) ctx {
-    NSDictionary* pointers  = @{@"QUAD": quads, @"DICT": dict, @"ID2T": i2t, @"T2ID": t2i};
-    NSData* pageData    = newQuadStoreHeaderData([ctx pageSize], prevID, pointers, indexes, NO);
+    return [self writeNewQuadStoreHeaderPageWithPreviousPageID:prevID rawDictionary:dict rawQuads:quads idToTerm:i2t termToID:t2i btreeIndexes:indexes updatingVersionIndex:NO updateContext:ctx];
+}
+
+/**
+ Writes a new header page. The version index is updated (with entries for every header written since its last update)
+ if updateVersions is YES or if VERSION_INDEX_INTERVAL headers have been written since its last update; otherwise the
+ new header points to the previous header's version index.
+ */
+- (NSInteger) writeNewQuadStoreHeaderPageWithPreviousPageID:(NSInteger)prevID rawDictionary:(GTWAOFRawDictionary*)dict rawQuads:(GTWAOFRawQuads*)quads idToTerm:(GTWAOFBTree*)i2t termToID:(GTWAOFBTree*)t2i btreeIndexes:(NSDictionary*)indexes updatingVersionIndex:(BOOL)updateVersions updateContext:(GTWAOFUpdateContext*) ctx {
+    NSMutableDictionary* pointers   = [@{@"QUAD": quads, @"DICT": dict, @"ID2T": i2t, @"T2ID": t2i} mutableCopy];
+    uint64_t ts                     = (uint64_t) [[NSDate date] timeIntervalSince1970];
+    int64_t generation              = 0;
+    if (prevID >= 0) {
+        GTWAOFPage* prev    = [ctx readPage:prevID];
+        // keep timestamps from going backwards so that the version index is ordered by timestamp as well as generation
+        ts                  = MAX(ts, header_timestamp(prev.data));
+        pointers[@"VERS"]   = [self versionIndexFollowingHeaderPage:prev updating:updateVersions generation:&generation updateContext:ctx];
+    }
+    NSData* pageData    = newQuadStoreHeaderData([ctx pageSize], prevID, generation, ts, pointers, indexes, NO);
     if(!pageData)
         return NO;
     GTWAOFPage* page    = [ctx createPageWithData:pageData];
@@ -885,6 +1454,58 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     return page.pageID;
 }
 
+/**
+ Returns the version index for a new header page following the given one, and sets generation to the generation of
+ the new header. The previous header's version index is reused as-is unless update is YES or VERSION_INDEX_INTERVAL
+ headers are missing from it, in which case entries for the missing headers on the previous-header chain are added in
+ one batch. If the previous header predates the version index, the index is built from the whole previous-header chain.
+ */
+- (GTWAOFBTree*) versionIndexFollowingHeaderPage:(GTWAOFPage*)prev updating:(BOOL)update generation:(int64_t*)generation updateContext:(GTWAOFUpdateContext*) ctx {
+    NSData* data            = prev.data;
+    NSInteger versPageID    = header_page_pointer(data, "VERS");
+    if (versPageID >= 0 || header_previous_page_id(data) < 0) {
+        int64_t prevGeneration      = (int64_t)[data gtw_integerFromBigLongLongRange:NSMakeRange(GEN_OFFSET, 8)];
+        *generation = prevGeneration + 1;
+        GTWMutableAOFBTree* versions;
+        if (versPageID >= 0) {
+            versions    = [[GTWMutableAOFBTree alloc] initWithRootPageID:versPageID fromAOF:ctx];
+        } else {
+            versions    = [[GTWMutableAOFBTree alloc] initEmptyBTreeWithKeySize:16 valueSize:8 updateContext:ctx];
+        }
+        int64_t next            = version_index_next_generation(versions);
+        if (!update && (prevGeneration - next + 1) < VERSION_INDEX_INTERVAL)
+            return versions;
+        
+        NSMutableArray* keys    = [NSMutableArray array];
+        NSMutableArray* values  = [NSMutableArray array];
+        int64_t gen             = prevGeneration;
+        for (NSInteger pid = prev.pageID; pid >= 0 && gen >= next; gen--) {
+            NSData* pageData    = [ctx readPage:pid].data;
+            [keys addObject:version_key(gen, header_timestamp(pageData))];
+            [values addObject:[NSData gtw_bigLongLongDataWithInteger:pid]];
+            pid = header_previous_page_id(pageData);
+        }
+        if ([keys count]) {
+            [versions insertValues:values forKeys:keys updateContext:ctx];
+        }
+        return versions;
+    }
+    
+    NSMutableArray* chain   = [NSMutableArray array];
+    for (NSInteger pid = prev.pageID; pid >= 0; pid = header_previous_page_id([ctx readPage:pid].data)) {
+        [chain addObject:@(pid)];
+    }
+    NSMutableArray* pairs   = [NSMutableArray array];
+    uint64_t lastTimestamp  = 0;
+    int64_t gen             = 0;
+    for (NSNumber* pid in [chain reverseObjectEnumerator]) {
+        lastTimestamp   = MAX(lastTimestamp, header_timestamp([ctx readPage:[pid integerValue]].data));
+        [pairs addObject:@[version_key(gen++, lastTimestamp), [NSData gtw_bigLongLongDataWithInteger:[pid integerValue]]]];
+    }
+    *generation = gen;
+    return [[GTWMutableAOFBTree alloc] initBTreeWithKeySize:16 valueSize:8 pairEnumerator:[pairs objectEnumerator] updateContext:ctx];
+}
+
 //- (NSUInteger) nextID {
 //    __block NSUInteger curMaxID = 0;
 //    [_dict enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
@@ -898,22 +1519,24 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 //}
 
 - (BOOL) addQuad:(id<GTWQuad>)q error:(NSError *__autoreleasing*)error {
+    [_writeLock lock];
+    BOOL ok = YES;
     if (_bulkLoading) {
+        if ([_bulkRemovedQuads count]) {
+            // pending removals must be applied before this addition to preserve the order of operations
+            [self flushBulkRemovedQuads];
+        }
         [_bulkQuads addObject:q];
         if ([_bulkQuads count] >= BULK_LOADING_BATCH_SIZE) {
             if (self.verbose)
                 NSLog(@"Flushing %llu quads", (unsigned long long)[_bulkQuads count]);
             [self flushBulkQuads];
         }
-        return YES;
     } else {
-        [self addQuads:@[q] error:error];
-        [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
-            [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:_quads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:_indexes updateContext:ctx];
-            return YES;
-        }];
-        return YES;
+        ok  = [self writeDeltaForQuads:@[q] removed:NO];
     }
+    [_writeLock unlock];
+    return ok;
 }
 
 - (NSDictionary*) keyOrderedDataDictionariesForQuads:(NSArray*)quads settingNewTermIDs:(NSMutableDictionary*)map {
@@ -971,6 +1594,197 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 }
 
 /**
+ Appends a single raw quads page listing the quads as added (or removed) to the delta, along with any new term IDs
+ and a new header page, in one update. Quads that are already in (or already missing from) the store are skipped.
+ Caller must hold the write lock.
+ */
+- (BOOL) writeDeltaForQuads:(NSArray*)quads removed:(BOOL)removed {
+    NSMutableDictionary* map    = removed ? nil : [NSMutableDictionary dictionary];
+    NSDictionary* keyOrderQuadDataDicts = [self keyOrderedDataDictionariesForQuads:quads settingNewTermIDs:map];
+    NSMutableArray* quadKeys    = [NSMutableArray array];
+    NSInteger keySize           = [_indexes[@"SPOG"] keySize];
+    for (NSData* key in keyOrderQuadDataDicts[@"SPOG"]) {
+        // quads with a term that has no ID can't be in the store (and produce a short key)
+        if ([key length] == keySize && [self containsQuadKey:key] == removed) {
+            [quadKeys addObject:key];
+        }
+    }
+    if (![quadKeys count])
+        return YES;
+    
+    __block GTWMutableAOFRawQuads* rawquads = self.mutableQuads;
+    __block NSInteger headPageID            = -1;
+    BOOL ok = [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        if ([map count]) {
+            [self addTermIDs:map updateContext:ctx];
+        }
+        if (removed) {
+            rawquads    = [rawquads mutableQuadsByRemovingQuads:quadKeys updateContext:ctx];
+        } else {
+            rawquads    = [rawquads mutableQuadsByAddingQuads:quadKeys updateContext:ctx];
+        }
+        headPageID  = [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:rawquads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:[self indexes] updateContext:ctx];
+        return YES;
+    }];
+    if (!ok)
+        return NO;
+    
+    NSUInteger count;
+    @synchronized(self) {
+        self.mutableQuads   = rawquads;
+        _head               = [self.aof readPage:headPageID];
+        for (NSData* key in quadKeys) {
+            [self _setDeltaState:!removed forQuadKey:key];
+        }
+        count   = [_deltaStates[@"SPOG"] count];
+    }
+    
+    if (count >= self.deltaMergeThreshold) {
+        // the quads are already recorded in the delta, so a failed merge (which is logged) is retried after the next update
+        [self scheduleDeltaMerge];
+    }
+    return YES;
+}
+
+/**
+ Merges the delta on the merge queue, so the writer that crosses the merge threshold doesn't wait for the indexes to
+ be rewritten. At most one merge is pending at a time.
+ */
+- (void) scheduleDeltaMerge {
+    @synchronized(self) {
+        if (_mergeScheduled)
+            return;
+        _mergeScheduled = YES;
+    }
+    dispatch_async(_mergeQueue, ^{
+        @synchronized(self) {
+            _mergeScheduled = NO;
+        }
+        [self mergeDelta];
+    });
+}
+
+/**
+ Blocks until any delta merge scheduled by a previous update has finished.
+ */
+- (void) waitForScheduledMerge {
+    dispatch_sync(_mergeQueue, ^{});
+}
+
+/**
+ Bulk-applies the delta to every index and starts a new, empty raw quads chain, writing a new header page.
+ The merge holds the write lock, so it is serialized with the commits of other writers, but readers are not blocked:
+ the merged indexes are built from new B+ tree objects and swapped in along with the empty delta (under the same lock
+ readers use to snapshot the indexes and delta) once the update is committed.
+ */
+- (BOOL) mergeDelta {
+    [_writeLock lock];
+    BOOL ok = [self _mergeDelta];
+    [_writeLock unlock];
+    return ok;
+}
+
+/**
+ Caller must hold the write lock.
+ */
+- (BOOL) _mergeDelta {
+    NSDictionary* indexes;
+    NSMutableDictionary* added      = [NSMutableDictionary dictionary];
+    NSMutableDictionary* removed    = [NSMutableDictionary dictionary];
+    @synchronized(self) {
+        if (![_deltaStates[@"SPOG"] count])
+            return YES;
+        indexes = [self indexes];
+        for (NSString* keyOrder in _deltaKeys) {
+            NSMutableArray* addedKeys   = [NSMutableArray array];
+            NSMutableArray* removedKeys = [NSMutableArray array];
+            NSDictionary* states        = _deltaStates[keyOrder];
+            for (NSData* key in _deltaKeys[keyOrder]) {
+                if ([states[key] boolValue]) {
+                    [addedKeys addObject:key];
+                } else {
+                    [removedKeys addObject:key];
+                }
+            }
+            added[keyOrder]     = addedKeys;
+            removed[keyOrder]   = removedKeys;
+        }
+    }
+    
+    if (self.verbose)
+        NSLog(@"Merging %llu delta quads into the indexes", (unsigned long long)[self deltaCount]);
+    
+    NSMutableDictionary* newindexes             = [NSMutableDictionary dictionary];
+    __block GTWMutableAOFRawQuads* rawquads     = nil;
+    __block NSInteger headPageID                = -1;
+    BOOL ok = [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
+        NSData* value   = [NSData data];
+        for (NSString* keyOrder in indexes) {
+            GTWAOFBTree* oldindex       = indexes[keyOrder];
+            GTWMutableAOFBTree* index   = [[GTWMutableAOFBTree alloc] initWithRootPageID:oldindex.pageID fromAOF:self.aof];
+            if ([removed[keyOrder] count]) {
+                [index removeValuesForKeys:removed[keyOrder] updateContext:ctx];
+            }
+            NSArray* keys   = added[keyOrder];
+            if ([keys count]) {
+                NSMutableArray* values  = [NSMutableArray arrayWithCapacity:[keys count]];
+                for (NSUInteger i = 0; i < [keys count]; i++) {
+                    [values addObject:value];
+                }
+                [index insertValues:values forKeys:keys updateContext:ctx];
+            }
+            newindexes[keyOrder]    = index;
+        }
+        rawquads    = [GTWMutableAOFRawQuads mutableQuadsWithQuads:@[] updateContext:ctx];
+        headPageID  = [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:rawquads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:newindexes updatingVersionIndex:YES updateContext:ctx];
+        return YES;
+    }];
+    if (!ok) {
+        NSLog(@"Failed to merge the delta into the quad store indexes");
+        return NO;
+    }
+    
+    @synchronized(self) {
+        _indexes            = newindexes;
+        self.mutableQuads   = rawquads;
+        _head               = [self.aof readPage:headPageID];
+        [self _loadDelta];
+    }
+    return YES;
+}
+
+/**
+ Adds the newly assigned term IDs in map (term data -> term ID) to the dictionary and the ID<->term B+ trees, and
+ records the next available term ID.
+ */
+- (void) addTermIDs:(NSDictionary*)map updateContext:(GTWAOFUpdateContext*)ctx {
+    GTWMutableAOFBTree* i2t = self.mutableBtreeID2Term;
+    GTWMutableAOFBTree* t2i = self.mutableBtreeTerm2ID;
+    if ([map count]) {
+        NSMutableDictionary* pageIDs    = [NSMutableDictionary dictionary];
+        self.mutableDict    = [self.mutableDict dictionaryByAddingDictionary:map settingPageIDs:pageIDs updateContext:ctx];
+        for (NSData* termData in map) {
+            NSData* hash    = [self hashData:termData];
+//            NSLog(@"generated hash %@ for term %@", hash, termData);
+            
+            NSNumber* pid   = pageIDs[termData];
+            NSData* termID  = map[termData];
+//            NSLog(@"map: %@ -> %@", termID, pid);
+            
+            NSData* value   = [NSData gtw_bigLongLongDataWithInteger:[pid integerValue]];
+            [i2t insertValue:value forKey:termID updateContext:ctx];
+            [t2i insertValue:termID forKey:hash updateContext:ctx];
+//            NSLog(@"****** %@ -> %@", hash, termID);
+        }
+    }
+    
+    NSData* token           = [NSData gtw_bigLongLongDataWithInteger:NEXT_ID_TOKEN_VALUE];
+    NSData* value           = [NSData gtw_bigLongLongDataWithInteger:_gen.nextID];
+    [i2t replaceValue:value forKey:token updateContext:ctx];
+}
+
+/**
+ Inserts the quads directly into the B+ tree indexes (used when bulk loading).
  Caller is responsible for calling the writeNewQuadStoreHeaderPage... method to write a new header page.
  */
 - (BOOL) addQuads:(NSArray*)quads error:(NSError *__autoreleasing*)error {
@@ -985,60 +1799,20 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     NSMutableDictionary* map    = [NSMutableDictionary dictionary];
     NSDictionary* keyOrderQuadDataDicts = [self keyOrderedDataDictionariesForQuads:quads settingNewTermIDs:map];
     
-    GTWMutableAOFBTree* i2t = self.mutableBtreeID2Term;
-    GTWMutableAOFBTree* t2i = self.mutableBtreeTerm2ID;
-    
-    //    NSLog(@"creating new quads head");
-    __block GTWMutableAOFRawQuads* rawquads = self.mutableQuads;
     __block NSInteger insertedCount = 0;
     [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
         for (NSString* keyOrder in keyOrderQuadDataDicts) {
             GTWMutableAOFBTree* index    = _indexes[keyOrder];
-            for (NSData* key in keyOrderQuadDataDicts[keyOrder]) {
-                NSData* value   = keyOrderQuadDataDicts[keyOrder][key];
-                BOOL ok = [index insertValue:value forKey:key updateContext:ctx];
-//                if (!ok) {
-//                    NSLog(@"******** Duplicate insert? %@", key);
-//                }
-                if ([keyOrder isEqualToString:@"SPOG"]) {
-                    if (ok) {
-                        insertedCount++;
-                    }
-                }
-            }
-        }
-        
-        if (NO) {
-            NSMutableArray* quadKeys   = [NSMutableArray array];
-            for (NSData* key in keyOrderQuadDataDicts[@"SPOG"]) {
-                [quadKeys addObject:key];
+            NSDictionary* quadData      = keyOrderQuadDataDicts[keyOrder];
+            NSArray* keys               = [quadData allKeys];
+            NSInteger inserted          = [index insertValues:[quadData objectsForKeys:keys notFoundMarker:[NSData data]] forKeys:keys updateContext:ctx];
+            if ([keyOrder isEqualToString:@"SPOG"]) {
+                insertedCount   = inserted;
             }
-            // don't duplicate the quad in the rawquads and the btree; at some point, we can add here until we overflow and then bulk load the rawquads into the btree
-            rawquads   = [rawquads mutableQuadsByAddingQuads:quadKeys updateContext:ctx];
         }
 //        NSLog(@"addQuads ctx: %@", ctx.createdPages);
 
-        if ([map count]) {
-            NSMutableDictionary* pageIDs    = [NSMutableDictionary dictionary];
-            self.mutableDict    = [self.mutableDict dictionaryByAddingDictionary:map settingPageIDs:pageIDs updateContext:ctx];
-            for (NSData* termData in map) {
-                NSData* hash    = [self hashData:termData];
-//                NSLog(@"generated hash %@ for term %@", hash, termData);
-                
-                NSNumber* pid   = pageIDs[termData];
-                NSData* termID  = map[termData];
-//                NSLog(@"map: %@ -> %@", termID, pid);
-                
-                NSData* value   = [NSData gtw_bigLongLongDataWithInteger:[pid integerValue]];
-                [i2t insertValue:value forKey:termID updateContext:ctx];
-                [t2i insertValue:termID forKey:hash updateContext:ctx];
-//                NSLog(@"****** %@ -> %@", hash, termID);
-            }
-        }
-        
-        NSData* token           = [NSData gtw_bigLongLongDataWithInteger:NEXT_ID_TOKEN_VALUE];
-        NSData* value           = [NSData gtw_bigLongLongDataWithInteger:_gen.nextID];
-        [i2t replaceValue:value forKey:token updateContext:ctx];
+        [self addTermIDs:map updateContext:ctx];
         return YES;
     }];
     
@@ -1056,46 +1830,75 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
 }
 
 - (BOOL) removeQuad: (id<GTWQuad>) q error:(NSError *__autoreleasing*)error {
+    [_writeLock lock];
+    BOOL ok = YES;
     if (_bulkLoading) {
-        NSLog(@"Cannot remove quad while bulk loading is in progress");
-        return NO;
+        if ([_bulkQuads count]) {
+            // pending additions must be applied before this removal to preserve the order of operations
+            [self flushBulkQuads];
+        }
+        [_bulkRemovedQuads addObject:q];
+        if ([_bulkRemovedQuads count] >= BULK_LOADING_BATCH_SIZE) {
+            if (self.verbose)
+                NSLog(@"Flushing %llu quad removals", (unsigned long long)[_bulkRemovedQuads count]);
+            [self flushBulkRemovedQuads];
+        }
     } else {
-        [self removeQuads:@[q] error:error];
-        [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
-            [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:_quads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:[self indexes] updateContext:ctx];
-            return YES;
-        }];
-        return YES;
+        ok  = [self writeDeltaForQuads:@[q] removed:YES];
     }
+    [_writeLock unlock];
+    return ok;
 }
 
 /**
+ Removes the quads from every index in a single update context (used when bulk loading).
  Caller is responsible for calling the writeNewQuadStoreHeaderPage... method to write a new header page.
  */
 - (BOOL) removeQuads:(NSArray*)quads error:(NSError *__autoreleasing*)error {
     NSDictionary* keyOrderQuadDataDictionaries = [self keyOrderedDataDictionariesForQuads:quads settingNewTermIDs:nil];
-    NSLog(@"Remove quads: %@", keyOrderQuadDataDictionaries[@"SPOG"]);
-    //    NSLog(@"creating new quads head");
-    GTWMutableAOFBTree* btree   = _indexes[@"SPOG"];
+    __block NSInteger removedCount  = 0;
     [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
-        for (NSData* key in keyOrderQuadDataDictionaries[@"SPOG"]) {
-            [btree removeValueForKey:key updateContext:ctx];
+        for (NSString* keyOrder in keyOrderQuadDataDictionaries) {
+            GTWMutableAOFBTree* index   = _indexes[keyOrder];
+            NSInteger keySize           = [index keySize];
+            NSMutableArray* keys        = [NSMutableArray array];
+            for (NSData* key in keyOrderQuadDataDictionaries[keyOrder]) {
+                // quads with a term that has no ID can't be in the store (and produce a short key)
+                if ([key length] == keySize) {
+                    [keys addObject:key];
+                }
+            }
+            if (![keys count])
+                continue;
+            NSInteger removed   = [index removeValuesForKeys:keys updateContext:ctx];
+            if ([keyOrder isEqualToString:@"SPOG"]) {
+                removedCount    = removed;
+            }
         }
-        //        NSLog(@"addQuads ctx: %@", ctx.createdPages);
         return YES;
     }];
+    if (self.verbose)
+        NSLog(@"Removed %lld quads", (long long)removedCount);
     return YES;
 }
 
 - (void) beginBulkLoad {
+    [_writeLock lock];
     if (_bulkLoading) {
         NSLog(@"beginBulkLoad called on store that is already bulk loading.");
+        [_writeLock unlock];
         return;
     }
+    // bulk loading writes directly to the indexes, so the delta (which overrides them) must be merged first
+    [self _mergeDelta];
     _bulkLoading    = YES;
     if (!_bulkQuads) {
         _bulkQuads      = [NSMutableArray array];
     }
+    if (!_bulkRemovedQuads) {
+        _bulkRemovedQuads   = [NSMutableArray array];
+    }
+    [_writeLock unlock];
 }
 
 - (NSInteger) flushBulkQuads {
@@ -1112,31 +1915,51 @@ static const uint64_t NEXT_ID_TOKEN_VALUE  = 0xffffffffffffffff;
     
 }
 
+- (NSInteger) flushBulkRemovedQuads {
+    NSError* error;
+    NSInteger count  = [_bulkRemovedQuads count];
+    if (count) {
+        [self removeQuads:_bulkRemovedQuads error:&error];
+        if (error) {
+            NSLog(@"%@", error);
+        }
+        [_bulkRemovedQuads removeAllObjects];
+    }
+    return count;
+}
+
 - (void) endBulkLoad {
+    [_writeLock lock];
     if (!_bulkLoading) {
         NSLog(@"endBulkLoad called on store that is not bulk loading.");
+        [_writeLock unlock];
         return;
     }
     NSInteger flushed   = [self flushBulkQuads];
+    flushed             += [self flushBulkRemovedQuads];
     _bulkLoading    = NO;
     
     if (flushed) {
         // rewrite QuadStore header page
+        __block NSInteger headPageID    = -1;
         [self.aof updateWithBlock:^BOOL(GTWAOFUpdateContext *ctx) {
-            [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:_quads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:[self indexes] updateContext:ctx];
+            headPageID  = [self writeNewQuadStoreHeaderPageWithPreviousPageID:self.pageID rawDictionary:_dict rawQuads:_quads idToTerm:_btreeID2Term termToID:_btreeTerm2ID btreeIndexes:[self indexes] updatingVersionIndex:YES updateContext:ctx];
             return YES;
         }];
+        @synchronized(self) {
+            _head   = [self.aof readPage:headPageID];
+        }
     }
+    [_writeLock unlock];
 }
 
-NSData* newQuadStoreHeaderData( NSUInteger pageSize, int64_t prevPageID, NSDictionary* pagePointers, NSDictionary* indexPointers, BOOL verbose ) {
+NSData* newQuadStoreHeaderData( NSUInteger pageSize, int64_t prevPageID, int64_t generation, uint64_t ts, NSDictionary* pagePointers, NSDictionary* indexPointers, BOOL verbose ) {
     int64_t max     = ((pageSize - DATA_OFFSET) / 16);
     if ([pagePointers count] > max) {
         NSLog(@"Too many index/page pointers seen while creating QuadStore header page");
         return nil;
     }
     
-    uint64_t ts     = (uint64_t) [[NSDate date] timeIntervalSince1970];
 //    int64_t prev    = (int64_t) prevPageID;
     if (verbose) {
         NSLog(@"creating quads page data with previous page ID: %lld (%lld)", prevPageID, prevPageID);
@@ -1145,12 +1968,14 @@ NSData* newQuadStoreHeaderData( NSUInteger pageSize, int64_t prevPageID, NSDicti
     
     NSData* timestamp   = [NSData gtw_bigLongLongDataWithInteger:ts];
     NSData* previous    = [NSData gtw_bigLongLongDataWithInteger:prevPageID];
+    NSData* gen         = [NSData gtw_bigLongLongDataWithInteger:generation];
 
     NSMutableData* data = [NSMutableData dataWithLength:pageSize];
     [data replaceBytesInRange:NSMakeRange(0, 4) withBytes:QUAD_STORE_COOKIE];
     
     [data replaceBytesInRange:NSMakeRange(TS_OFFSET, 8) withBytes:timestamp.bytes];
     [data replaceBytesInRange:NSMakeRange(PREV_OFFSET, 8) withBytes:previous.bytes];
+    [data replaceBytesInRange:NSMakeRange(GEN_OFFSET, 8) withBytes:gen.bytes];
     
     int offset  = DATA_OFFSET;
     for (NSString* name in indexPointers) {
@@ -12,6 +12,10 @@
 
 #define RAW_QUADS_COOKIE "RQDS"
 
+typedef NS_OPTIONS(uint32_t, GTWAOFRawQuadsFlags) {
+    GTWAOFRawQuadsRemoved = 1
+};
+
 @class GTWMutableAOFRawQuads;
 
 @interface GTWAOFRawQuads : NSObject<GTWAOFBackedObject> {
@@ -33,6 +37,8 @@
 - (GTWAOFRawQuads*) initWithPage:(GTWAOFPage*)page fromAOF:(id<GTWAOF>)aof;
 
 - (NSUInteger) count;
+- (NSInteger) flags;
+- (BOOL) isRemovedQuadsPage;
 - (id) objectAtIndex: (NSUInteger) index;
 - (void)enumerateDataRangeUsingBlock:(void (^)(NSData* obj, NSRange range, BOOL *stop))block;
 - (void)enumerateObjectsUsingBlock:(void (^)(id obj, NSUInteger idx, BOOL *stop))block;
@@ -47,6 +53,8 @@
 
 + (GTWMutableAOFRawQuads*) mutableQuadsWithQuads:(NSArray *)quads updateContext:(GTWAOFUpdateContext*) ctx;
 - (GTWMutableAOFRawQuads*) mutableQuadsByAddingQuads:(NSArray*) quads updateContext:(GTWAOFUpdateContext*) ctx;
+- (GTWMutableAOFRawQuads*) mutableQuadsByRemovingQuads:(NSArray*) quads updateContext:(GTWAOFUpdateContext*) ctx;
 + (GTWAOFPage*) quadsPageWithQuads:(NSArray*)quads previousPageID: (NSInteger) prevID updateContext:(GTWAOFUpdateContext*) ctx;
++ (GTWAOFPage*) quadsPageWithQuads:(NSArray*)quads previousPageID: (NSInteger) prevID flags:(GTWAOFRawQuadsFlags)flags updateContext:(GTWAOFUpdateContext*) ctx;
 
 @end
@@ -8,7 +8,7 @@
 
 /**
  4  cookie          [RQDS]
- 4  padding
+ 4  flags
  8  timestamp       (seconds since epoch)
  8  prev_page_id
  8  count
@@ -19,6 +19,7 @@
 #import "GTWAOFPage+GTWAOFLinkedPage.h"
 #import "NSData+GTWCompare.h"
 
+#define FLAGS_OFFSET    4
 #define TS_OFFSET       8
 #define PREV_OFFSET     16
 #define COUNT_OFFSET    24
@@ -138,6 +139,20 @@
     return count;
 }
 
+- (NSInteger) flags {
+    GTWAOFPage* p       = _head;
+    uint32_t big_flags  = 0;
+    [p.data getBytes:&big_flags range:NSMakeRange(FLAGS_OFFSET, 4)];
+    return (NSInteger)NSSwapBigIntToHost(big_flags);
+}
+
+/**
+ Pages with the GTWAOFRawQuadsRemoved flag set list quads that have been removed (tombstones) rather than added.
+ */
+- (BOOL) isRemovedQuadsPage {
+    return ([self flags] & GTWAOFRawQuadsRemoved) ? YES : NO;
+}
+
 - (NSArray*) allObjects {
     GTWAOFPage* p   = _head;
     NSData* data    = p.data;
@@ -207,7 +222,7 @@
     } followTail:YES];
 }
 
-NSMutableData* emptyQuadsData( NSUInteger pageSize, int64_t prevPageID, BOOL verbose ) {
+NSMutableData* emptyQuadsData( NSUInteger pageSize, int64_t prevPageID, uint32_t flags, BOOL verbose ) {
     uint64_t ts     = (uint64_t) [[NSDate date] timeIntervalSince1970];
     if (verbose) {
         NSLog(@"creating quads page data with previous page ID: %lld (%lld)", prevPageID, prevPageID);
@@ -216,22 +231,24 @@ NSMutableData* emptyQuadsData( NSUInteger pageSize, int64_t prevPageID, BOOL ver
     NSData* timestamp   = [NSData gtw_bigLongLongDataWithInteger:ts];
     NSData* previous    = [NSData gtw_bigLongLongDataWithInteger:prevPageID];
     NSData* count       = [NSData gtw_bigLongLongDataWithInteger:0];
+    uint32_t bigflags   = NSSwapHostIntToBig(flags);
     
     NSMutableData* data = [NSMutableData dataWithLength:pageSize];
     [data replaceBytesInRange:NSMakeRange(0, 4) withBytes:RAW_QUADS_COOKIE];
+    [data replaceBytesInRange:NSMakeRange(FLAGS_OFFSET, 4) withBytes:&bigflags];
     [data replaceBytesInRange:NSMakeRange(TS_OFFSET, 8) withBytes:timestamp.bytes];
     [data replaceBytesInRange:NSMakeRange(PREV_OFFSET, 8) withBytes:previous.bytes];
     [data replaceBytesInRange:NSMakeRange(COUNT_OFFSET, 8) withBytes:count.bytes];
     return data;
 }
 
-NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPageID, BOOL verbose ) {
+NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPageID, uint32_t flags, BOOL verbose ) {
     int64_t max     = (pageSize / 32) - 1;
     int64_t qcount  = [quads count];
     int64_t count   = (max < qcount) ? max : qcount;
     NSData* countdata  = [NSData gtw_bigLongLongDataWithInteger:count];
     
-    NSMutableData* data = emptyQuadsData(pageSize, prevPageID, verbose);
+    NSMutableData* data = emptyQuadsData(pageSize, prevPageID, flags, verbose);
     [data replaceBytesInRange:NSMakeRange(COUNT_OFFSET, 8) withBytes:countdata.bytes];
     __block int offset  = DATA_OFFSET;
     NSUInteger i;
@@ -268,12 +285,11 @@ NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPa
     if (prev) {
         GTWMutableAOFRawQuads* newprev  = [prev rewriteWithUpdateContext:ctx];
         prevID  = newprev.pageID;
-        GTWMutableAOFRawQuads* newquads = [newprev mutableQuadsByAddingQuads:quads updateContext:ctx];
-        return newquads;
-    } else {
-        GTWMutableAOFRawQuads* newquads = [GTWMutableAOFRawQuads mutableQuadsWithQuads:quads updateContext:ctx];
-        return newquads;
     }
+    GTWAOFPage* page                = [GTWMutableAOFRawQuads quadsPageWithQuads:quads previousPageID:prevID flags:(GTWAOFRawQuadsFlags)[self flags] updateContext:ctx];
+    GTWMutableAOFRawQuads* newquads = [[GTWMutableAOFRawQuads alloc] initWithPage:page fromAOF:ctx];
+    [ctx registerPageObject:newquads];
+    return newquads;
 }
 
 @end
@@ -282,6 +298,10 @@ NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPa
 @implementation GTWMutableAOFRawQuads
 
 + (GTWAOFPage*) quadsPageWithQuads:(NSArray*)quads previousPageID: (NSInteger) prevID updateContext:(GTWAOFUpdateContext*) ctx {
+    return [self quadsPageWithQuads:quads previousPageID:prevID flags:0 updateContext:ctx];
+}
+
++ (GTWAOFPage*) quadsPageWithQuads:(NSArray*)quads previousPageID: (NSInteger) prevID flags:(GTWAOFRawQuadsFlags)flags updateContext:(GTWAOFUpdateContext*) ctx {
     NSMutableArray* q   = [[quads sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2) {
         int r   = memcmp([obj1 bytes], [obj2 bytes], 32);
         if (r < 0) {
@@ -298,14 +318,14 @@ NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPa
     if ([q count]) {
         while ([q count]) {
             //                NSLog(@"%llu quads remaining", (unsigned long long)[q count]);
-            NSData* data    = newQuadsData([ctx pageSize], q, prev, NO);
+            NSData* data    = newQuadsData([ctx pageSize], q, prev, flags, NO);
             if(!data)
                 return NO;
             page    = [ctx createPageWithData:data];
             prev    = page.pageID;
         }
     } else {
-        NSData* empty   = emptyQuadsData([ctx pageSize], prev, NO);
+        NSData* empty   = emptyQuadsData([ctx pageSize], prev, flags, NO);
         page            = [ctx createPageWithData:empty];
     }
     
@@ -328,6 +348,18 @@ NSData* newQuadsData( NSUInteger pageSize, NSMutableArray* quads, int64_t prevPa
     return n;
 }
 
+/**
+ Appends pages listing quads that have been removed. Readers of the page chain treat these as tombstones for any
+ earlier occurrence of the same quads.
+ */
+- (GTWMutableAOFRawQuads*) mutableQuadsByRemovingQuads:(NSArray*) quads updateContext:(GTWAOFUpdateContext*) ctx {
+    int64_t prev  = self.pageID;
+    GTWAOFPage* page    = [GTWMutableAOFRawQuads quadsPageWithQuads:quads previousPageID:prev flags:GTWAOFRawQuadsRemoved updateContext:ctx];
+    GTWMutableAOFRawQuads* n    = [[GTWMutableAOFRawQuads alloc] initWithPage:page fromAOF:ctx];
+    [ctx registerPageObject:n];
+    return n;
+}
+
 - (GTWMutableAOFRawQuads*) initFindingQuadsInAOF:(id<GTWAOF,GTWMutableAOF>)aof {
     if (self = [self init]) {
         self.aof    = aof;
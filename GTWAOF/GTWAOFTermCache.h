@@ -0,0 +1,42 @@
+//
+//  GTWAOFTermCache.h
+//  GTWAOF
+//
+//  Created by Gregory Williams on 10/19/26.
+//  Copyright (c) 2026 Gregory Todd Williams. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "GTWAOF.h"
+
+#define TERM_CACHE_COST_LIMIT   (32 * 1024 * 1024)
+
+typedef NS_ENUM(NSInteger, GTWAOFTermCacheKind) {
+    GTWAOFTermCacheTermForID,
+    GTWAOFTermCacheIDForTermData,
+    GTWAOFTermCacheDataForTerm
+};
+
+/**
+ A bounded cache of term IDs, decoded terms, and term encodings. Since term IDs are never reassigned in an
+ append-only file, a single cache is shared by every quad store state read from the same AOF.
+
+ Entries are spread over independently locked stripes. Each stripe admits new entries through a small LRU window;
+ entries leaving the window only displace the next victim of the main region if they have been requested more often (as
+ estimated by a count-min sketch), so terms seen once during a scan don't evict the hot set. The main region is split
+ into probation and protected segments, and only entries hit again after admission are protected from eviction.
+ */
+@interface GTWAOFTermCache : NSObject {
+    NSArray* _stripes;
+}
+
+@property (readonly) NSUInteger costLimit;
+
++ (GTWAOFTermCache*) termCacheForAOF:(id<GTWAOF>)aof;
+- (GTWAOFTermCache*) initWithCostLimit:(NSUInteger)costLimit;
+- (id) objectForKey:(id)key kind:(GTWAOFTermCacheKind)kind;
+- (void) setObject:(id)object forKey:(id)key kind:(GTWAOFTermCacheKind)kind cost:(NSUInteger)cost;
+- (NSUInteger) count;
+- (NSUInteger) totalCost;
+
+@end
@@ -0,0 +1,376 @@
+//
+//  GTWAOFTermCache.m
+//  GTWAOF
+//
+//  Created by Gregory Williams on 10/19/26.
+//  Copyright (c) 2026 Gregory Todd Williams. All rights reserved.
+//
+
+#import "GTWAOFTermCache.h"
+#import "GTWAOFUpdateContext.h"
+#import <objc/runtime.h>
+
+#define TERM_CACHE_STRIPES          16
+#define TERM_CACHE_KINDS            3
+#define TERM_CACHE_ENTRY_OVERHEAD   64
+#define TERM_CACHE_AVERAGE_COST     128
+#define TERM_CACHE_SKETCH_DEPTH     4
+#define TERM_CACHE_MAX_FREQUENCY    15
+#define TERM_CACHE_PROTECTED_PERCENT    80
+
+static char GTWAOFTermCacheKey;
+
+static uint64_t mix_hash ( uint64_t h ) {
+    h   ^= h >> 33;
+    h   *= 0xff51afd7ed558ccdULL;
+    h   ^= h >> 33;
+    h   *= 0xc4ceb9fe1a85ec53ULL;
+    h   ^= h >> 33;
+    return h;
+}
+
+static uint64_t entry_hash ( id key, GTWAOFTermCacheKind kind ) {
+    return mix_hash((uint64_t)[key hash] + ((uint64_t)kind * 0x9e3779b97f4a7c15ULL));
+}
+
+typedef NS_ENUM(NSInteger, GTWAOFTermCacheSegment) {
+    GTWAOFTermCacheWindowSegment,
+    GTWAOFTermCacheProbationSegment,
+    GTWAOFTermCacheProtectedSegment
+};
+
+/**
+ Entries are owned by the stripe's dictionaries; the recency list links are not retained.
+ */
+@interface GTWAOFTermCacheEntry : NSObject
+@property (nonatomic, strong) id key;
+@property (nonatomic, strong) id object;
+@property (nonatomic) GTWAOFTermCacheKind kind;
+@property (nonatomic) NSUInteger cost;
+@property (nonatomic) uint64_t keyHash;
+@property (nonatomic) GTWAOFTermCacheSegment segment;
+@property (nonatomic, unsafe_unretained) GTWAOFTermCacheEntry* prev;
+@property (nonatomic, unsafe_unretained) GTWAOFTermCacheEntry* next;
+@end
+
+@implementation GTWAOFTermCacheEntry
+@end
+
+/**
+ A recency-ordered list of entries (most recently used first) and their total cost.
+ */
+@interface GTWAOFTermCacheList : NSObject
+@property (nonatomic, unsafe_unretained) GTWAOFTermCacheEntry* head;
+@property (nonatomic, unsafe_unretained) GTWAOFTermCacheEntry* tail;
+@property (nonatomic) NSUInteger cost;
+@property (nonatomic) NSUInteger limit;
+@end
+
+@implementation GTWAOFTermCacheList
+
+- (void) addEntry:(GTWAOFTermCacheEntry*)e {
+    e.prev  = nil;
+    e.next  = _head;
+    if (_head)
+        _head.prev  = e;
+    _head   = e;
+    if (!_tail)
+        _tail   = e;
+    _cost   += e.cost;
+}
+
+- (void) removeEntry:(GTWAOFTermCacheEntry*)e {
+    if (e.prev) {
+        e.prev.next = e.next;
+    } else {
+        _head   = e.next;
+    }
+    if (e.next) {
+        e.next.prev = e.prev;
+    } else {
+        _tail   = e.prev;
+    }
+    e.prev  = nil;
+    e.next  = nil;
+    _cost   -= e.cost;
+}
+
+- (void) touchEntry:(GTWAOFTermCacheEntry*)e {
+    if (e == _head)
+        return;
+    [self removeEntry:e];
+    [self addEntry:e];
+}
+
+@end
+
+/**
+ One lock-protected partition of the cache: a window list that admits every new entry, and a main region that entries
+ leaving the window must win a frequency comparison to enter. The main region is a segmented LRU: admitted entries
+ start in the probation segment and are promoted to the protected segment on their next hit, and entries pushed out of
+ the protected segment go back to probation, so eviction victims are always taken from entries that have not been
+ requested since their admission (or demotion). A count-min sketch tracks recent request frequencies (4 rows of
+ saturating counters, halved every sampleSize requests so that old popularity fades).
+ */
+@interface GTWAOFTermCacheStripe : NSObject {
+    NSLock* _lock;
+    NSMapTable* _entries[TERM_CACHE_KINDS];
+    GTWAOFTermCacheList* _window;
+    GTWAOFTermCacheList* _probation;
+    GTWAOFTermCacheList* _protected;
+    NSUInteger _mainLimit;
+    uint8_t* _sketch;
+    NSUInteger _sketchMask;
+    NSUInteger _samples;
+    NSUInteger _sampleSize;
+}
+@end
+
+@implementation GTWAOFTermCacheStripe
+
+- (GTWAOFTermCacheStripe*) initWithCostLimit:(NSUInteger)limit {
+    if (self = [self init]) {
+        _lock           = [[NSLock alloc] init];
+        for (NSInteger i = 0; i < TERM_CACHE_KINDS; i++) {
+            // terms aren't necessarily copyable, so keys are retained rather than copied
+            _entries[i] = [NSMapTable strongToStrongObjectsMapTable];
+        }
+        _window         = [[GTWAOFTermCacheList alloc] init];
+        _probation      = [[GTWAOFTermCacheList alloc] init];
+        _protected      = [[GTWAOFTermCacheList alloc] init];
+        _window.limit   = MAX(limit / 100, TERM_CACHE_AVERAGE_COST);
+        _mainLimit      = (limit > _window.limit) ? (limit - _window.limit) : 0;
+        // probation takes whatever the protected segment leaves of the main region
+        _protected.limit    = (_mainLimit / 100) * TERM_CACHE_PROTECTED_PERCENT;
+
+        NSUInteger width    = 64;
+        while (width < (limit / TERM_CACHE_AVERAGE_COST))
+            width   <<= 1;
+        _sketchMask     = width - 1;
+        _sampleSize     = 10 * width;
+        _sketch         = calloc(TERM_CACHE_SKETCH_DEPTH * width, sizeof(uint8_t));
+        if (!_sketch)
+            return nil;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    free(_sketch);
+}
+
+- (NSUInteger) sketchIndexForHash:(uint64_t)hash row:(NSInteger)row {
+    uint64_t h  = mix_hash(hash + (uint64_t)row * 0x9e3779b97f4a7c15ULL);
+    return (row * (_sketchMask + 1)) + (NSUInteger)(h & _sketchMask);
+}
+
+- (void) incrementFrequencyForHash:(uint64_t)hash {
+    for (NSInteger row = 0; row < TERM_CACHE_SKETCH_DEPTH; row++) {
+        NSUInteger i    = [self sketchIndexForHash:hash row:row];
+        if (_sketch[i] < TERM_CACHE_MAX_FREQUENCY)
+            _sketch[i]++;
+    }
+    if (++_samples >= _sampleSize) {
+        NSUInteger size = TERM_CACHE_SKETCH_DEPTH * (_sketchMask + 1);
+        for (NSUInteger i = 0; i < size; i++) {
+            _sketch[i]  >>= 1;
+        }
+        _samples    /= 2;
+    }
+}
+
+- (NSUInteger) frequencyForHash:(uint64_t)hash {
+    NSUInteger freq = TERM_CACHE_MAX_FREQUENCY;
+    for (NSInteger row = 0; row < TERM_CACHE_SKETCH_DEPTH; row++) {
+        freq    = MIN(freq, _sketch[[self sketchIndexForHash:hash row:row]]);
+    }
+    return freq;
+}
+
+- (GTWAOFTermCacheList*) listForSegment:(GTWAOFTermCacheSegment)segment {
+    switch (segment) {
+        case GTWAOFTermCacheProbationSegment:
+            return _probation;
+        case GTWAOFTermCacheProtectedSegment:
+            return _protected;
+        default:
+            return _window;
+    }
+}
+
+- (void) evictEntry:(GTWAOFTermCacheEntry*)e {
+    [[self listForSegment:e.segment] removeEntry:e];
+    [_entries[e.kind] removeObjectForKey:e.key];
+}
+
+/**
+ Moves an entry hit in the probation segment to the protected segment, demoting the least recently used protected
+ entries back to probation to keep the protected segment within its limit.
+ */
+- (void) promoteEntry:(GTWAOFTermCacheEntry*)e {
+    [_probation removeEntry:e];
+    e.segment   = GTWAOFTermCacheProtectedSegment;
+    [_protected addEntry:e];
+    while (_protected.cost > _protected.limit && _protected.tail != e) {
+        GTWAOFTermCacheEntry* demoted   = _protected.tail;
+        [_protected removeEntry:demoted];
+        demoted.segment = GTWAOFTermCacheProbationSegment;
+        [_probation addEntry:demoted];
+    }
+}
+
+/**
+ Returns the main region's least recently used entry, which is the next to be evicted.
+ */
+- (GTWAOFTermCacheEntry*) mainVictim {
+    return _probation.tail ? _probation.tail : _protected.tail;
+}
+
+- (id) objectForKey:(id)key kind:(GTWAOFTermCacheKind)kind hash:(uint64_t)hash {
+    [_lock lock];
+    [self incrementFrequencyForHash:hash];
+    GTWAOFTermCacheEntry* e = [_entries[kind] objectForKey:key];
+    id object   = nil;
+    if (e) {
+        if (e.segment == GTWAOFTermCacheProbationSegment) {
+            [self promoteEntry:e];
+        } else {
+            [[self listForSegment:e.segment] touchEntry:e];
+        }
+        object  = e.object;
+    }
+    [_lock unlock];
+    return object;
+}
+
+- (void) setObject:(id)object forKey:(id)key kind:(GTWAOFTermCacheKind)kind cost:(NSUInteger)cost hash:(uint64_t)hash {
+    [_lock lock];
+    GTWAOFTermCacheEntry* e = [_entries[kind] objectForKey:key];
+    if (e) {
+        [self evictEntry:e];
+    }
+    if (cost > _mainLimit) {
+        [_lock unlock];
+        return;
+    }
+
+    e           = [[GTWAOFTermCacheEntry alloc] init];
+    e.key       = key;
+    e.object    = object;
+    e.kind      = kind;
+    e.cost      = cost;
+    e.keyHash   = hash;
+    [_entries[kind] setObject:e forKey:key];
+    [_window addEntry:e];
+
+    while (_window.cost > _window.limit) {
+        GTWAOFTermCacheEntry* candidate = _window.tail;
+        [_window removeEntry:candidate];
+        if ((_probation.cost + _protected.cost + candidate.cost) > _mainLimit) {
+            // the candidate has to be requested more often than the main region's next victim to replace it
+            GTWAOFTermCacheEntry* victim    = [self mainVictim];
+            if (!victim || [self frequencyForHash:candidate.keyHash] <= [self frequencyForHash:victim.keyHash]) {
+                [_entries[candidate.kind] removeObjectForKey:candidate.key];
+                continue;
+            }
+            while ((victim = [self mainVictim]) && (_probation.cost + _protected.cost + candidate.cost) > _mainLimit) {
+                [self evictEntry:victim];
+            }
+        }
+        candidate.segment   = GTWAOFTermCacheProbationSegment;
+        [_probation addEntry:candidate];
+    }
+    [_lock unlock];
+}
+
+- (NSUInteger) count {
+    [_lock lock];
+    NSUInteger count    = 0;
+    for (NSInteger i = 0; i < TERM_CACHE_KINDS; i++) {
+        count   += [_entries[i] count];
+    }
+    [_lock unlock];
+    return count;
+}
+
+- (NSUInteger) totalCost {
+    [_lock lock];
+    NSUInteger cost = _window.cost + _probation.cost + _protected.cost;
+    [_lock unlock];
+    return cost;
+}
+
+@end
+
+@implementation GTWAOFTermCache
+
+/**
+ Returns the cache shared by all quad store states read from the given AOF, creating it on first use. An update
+ context resolves to the cache of the AOF it updates, so states created during an update share the same cache.
+ */
++ (GTWAOFTermCache*) termCacheForAOF:(id<GTWAOF>)aof {
+    while ([(id)aof isKindOfClass:[GTWAOFUpdateContext class]]) {
+        aof = [(GTWAOFUpdateContext*)aof aof];
+    }
+    if (!aof)
+        return nil;
+    @synchronized(aof) {
+        GTWAOFTermCache* cache  = objc_getAssociatedObject(aof, &GTWAOFTermCacheKey);
+        if (!cache) {
+            cache   = [[GTWAOFTermCache alloc] initWithCostLimit:TERM_CACHE_COST_LIMIT];
+            objc_setAssociatedObject(aof, &GTWAOFTermCacheKey, cache, OBJC_ASSOCIATION_RETAIN);
+        }
+        return cache;
+    }
+}
+
+- (GTWAOFTermCache*) initWithCostLimit:(NSUInteger)costLimit {
+    if (self = [self init]) {
+        _costLimit  = costLimit;
+        NSMutableArray* stripes = [NSMutableArray arrayWithCapacity:TERM_CACHE_STRIPES];
+        for (NSInteger i = 0; i < TERM_CACHE_STRIPES; i++) {
+            GTWAOFTermCacheStripe* stripe   = [[GTWAOFTermCacheStripe alloc] initWithCostLimit:(costLimit / TERM_CACHE_STRIPES)];
+            if (!stripe)
+                return nil;
+            [stripes addObject:stripe];
+        }
+        _stripes    = stripes;
+    }
+    return self;
+}
+
+- (GTWAOFTermCacheStripe*) stripeForHash:(uint64_t)hash {
+    return _stripes[(NSUInteger)(hash >> 60) % TERM_CACHE_STRIPES];
+}
+
+- (id) objectForKey:(id)key kind:(GTWAOFTermCacheKind)kind {
+    if (!key)
+        return nil;
+    uint64_t hash   = entry_hash(key, kind);
+    return [[self stripeForHash:hash] objectForKey:key kind:kind hash:hash];
+}
+
+- (void) setObject:(id)object forKey:(id)key kind:(GTWAOFTermCacheKind)kind cost:(NSUInteger)cost {
+    if (!(object && key))
+        return;
+    uint64_t hash   = entry_hash(key, kind);
+    [[self stripeForHash:hash] setObject:object forKey:key kind:kind cost:(cost + TERM_CACHE_ENTRY_OVERHEAD) hash:hash];
+}
+
+- (NSUInteger) count {
+    NSUInteger count    = 0;
+    for (GTWAOFTermCacheStripe* stripe in _stripes) {
+        count   += [stripe count];
+    }
+    return count;
+}
+
+- (NSUInteger) totalCost {
+    NSUInteger cost = 0;
+    for (GTWAOFTermCacheStripe* stripe in _stripes) {
+        cost    += [stripe totalCost];
+    }
+    return cost;
+}
+
+@end
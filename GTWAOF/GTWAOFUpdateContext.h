@@ -22,6 +22,7 @@
 
 - (NSUInteger) pageSize;
 - (GTWAOFUpdateContext*) initWithAOF: (id<GTWAOF>) aof;
+- (id<GTWAOF>) aof;
 - (GTWAOFPage*) readPage: (NSInteger) pageID;
 - (GTWAOFPage*) createPageWithData: (NSData*)data;
 - (void) registerPageObject:(id)object;
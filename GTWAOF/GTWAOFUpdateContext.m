@@ -22,6 +22,10 @@
     return self;
 }
 
+- (id<GTWAOF>) aof {
+    return _aof;
+}
+
 - (NSUInteger) pageSize {
     return [_aof pageSize];
 }
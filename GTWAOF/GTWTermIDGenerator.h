@@ -20,6 +20,11 @@
 - (NSData*) identifierForTerm:(id<GTWTerm>)term assign:(BOOL)assign;
 - (id<GTWTerm>) termForIdentifier:(NSData*)ident;
 
+- (NSArray*) identifierRangesForTermType:(GTWTermType)type;
+- (NSArray*) identifierRangesForIntegerValuesFrom:(int64_t)min to:(int64_t)max;
+- (NSArray*) identifierRangesForDateValuesFrom:(NSString*)min to:(NSString*)max;
+- (NSArray*) identifierRangesForNumericValuesFrom:(double)min to:(double)max;
+
 @end
 
 /*
@@ -99,6 +104,17 @@
  narrow search scope by restricting to type = NODE_TYPE_DATATYPE and EF = 0
  (specifically, the high 4 bits of node id = 0xA).
  
+ The identifierRanges... methods return these restrictions as arrays of
+ inclusive @[lowerID, upperID] pairs, suitable for passing to the quad store's
+ identifier-range enumeration. Ranges for inlined values are always paired with
+ the range of non-inlined datatype literals, so the result is a superset of the
+ matching terms and the filter must still be evaluated on the results.
+ 
+ Inlined decimals are packed with their scale in the high byte, and inlined
+ floats as their lexical value, so neither sorts in value order. The numeric
+ ranges therefore cover every inlined decimal and float along with the inlined
+ integers in the requested range.
+ 
  Node position in a triple can provide range restrictions:
  Subject: high 4 bits of node id <= 0x5
  Predicate: high 4 bits of node id = [0x4, 0x5]
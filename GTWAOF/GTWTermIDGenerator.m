@@ -11,6 +11,7 @@
 #import <GTWSWBase/GTWLiteral.h>
 #import <GTWSWBase/GTWBlank.h>
 #include <arpa/inet.h>
+#include <math.h>
 #import "NSData+GTWCompare.h"
 
 #define MAX_ORDINAL_VALUE	0x00FFFFFFFFFFFFFFLL
@@ -774,6 +775,95 @@ static uint16_t inlined_datetime_day ( uint64_t idvalue ) {
 
 #pragma mark -
 
+static NSData* node_id_with_high_byte ( unsigned char byte0, unsigned char fill ) {
+    unsigned char bytes[8];
+    memset(bytes, fill, 8);
+    bytes[0]    = byte0;
+    return [NSData dataWithBytes:bytes length:8];
+}
+
+static NSArray* node_id_range ( unsigned char lowByte, unsigned char highByte ) {
+    return @[node_id_with_high_byte(lowByte, 0x00), node_id_with_high_byte(highByte, 0xFF)];
+}
+
+- (NSArray*) nonInlinedDatatypeIdentifierRange {
+    unsigned char byte0 = (NODE_TYPE_DATATYPE << 4) | NODE_SUBTYPE_NONE;
+    return node_id_range(byte0, byte0);
+}
+
+- (NSArray*) identifierRangesForTermType:(GTWTermType)type {
+    // the high nibble holds the node type (with the EF bit as its low bit)
+    switch (type) {
+        case GTWTermBlank:
+            return @[node_id_range(NODE_TYPE_BLANK << 4, ((NODE_TYPE_BLANK+1) << 4) | 0x0F)];
+        case GTWTermIRI:
+            return @[node_id_range(NODE_TYPE_IRI << 4, ((NODE_TYPE_IRI+1) << 4) | 0x0F)];
+        case GTWTermLiteral:
+            return @[node_id_range(NODE_TYPE_SIMPLE << 4, ((NODE_TYPE_DATATYPE+1) << 4) | 0x0F)];
+        default:
+            NSLog(@"*** unknown node type %d in identifierRangesForTermType:\n", (int)type);
+            return nil;
+    }
+}
+
+- (NSArray*) identifierRangesForIntegerValuesFrom:(int64_t)min to:(int64_t)max {
+    NSMutableArray* ranges  = [NSMutableArray array];
+    if (min <= max && max >= 0) {
+        // inlined integers are non-negative and stored in value order in the low 56 bits
+        uint64_t lower  = (min < 0) ? 0 : (uint64_t) min;
+        uint64_t upper  = ((uint64_t) max > MAX_INTEGER_VALUE) ? MAX_INTEGER_VALUE : (uint64_t) max;
+        if (lower <= upper) {
+            NSData* lowerID = [self newInlineNodeIDOfType:NODE_TYPE_DATATYPE subType:NODE_SUBTYPE_INTEGER value:&lower arg1:NULL arg2:NULL];
+            NSData* upperID = [self newInlineNodeIDOfType:NODE_TYPE_DATATYPE subType:NODE_SUBTYPE_INTEGER value:&upper arg1:NULL arg2:NULL];
+            [ranges addObject:@[lowerID, upperID]];
+        }
+    }
+    [ranges addObject:[self nonInlinedDatatypeIdentifierRange]];
+    return ranges;
+}
+
+- (NSArray*) identifierRangesForDateValuesFrom:(NSString*)min to:(NSString*)max {
+    NSMutableArray* ranges  = [NSMutableArray array];
+    NSData* example         = [self pack_date:@"2000-01-01"];
+    unsigned char byte0     = ((const unsigned char*) example.bytes)[0];
+    NSData* lowerID         = min ? [self pack_date:min] : node_id_with_high_byte(byte0, 0x00);
+    NSData* upperID         = max ? [self pack_date:max] : node_id_with_high_byte(byte0, 0xFF);
+    if (lowerID && upperID) {
+        // inlined dates are packed as year, month, day from the high bits down, so they sort in value order
+        if ([lowerID gtw_compare:upperID] != NSOrderedDescending) {
+            [ranges addObject:@[lowerID, upperID]];
+        }
+    } else {
+        // a bound that can't be inlined; fall back to every inlined date
+        [ranges addObject:node_id_range(byte0, byte0)];
+    }
+    [ranges addObject:[self nonInlinedDatatypeIdentifierRange]];
+    return ranges;
+}
+
+- (NSArray*) identifierRangesForNumericValuesFrom:(double)min to:(double)max {
+    NSMutableArray* ranges  = [NSMutableArray array];
+    if (min <= max && max >= 0) {
+        int64_t lower   = (min < 0) ? 0 : (int64_t) ceil(min);
+        int64_t upper   = (max > MAX_INTEGER_VALUE) ? MAX_INTEGER_VALUE : (int64_t) floor(max);
+        if (lower <= upper) {
+            // includes the non-inlined datatype range
+            [ranges addObjectsFromArray:[self identifierRangesForIntegerValuesFrom:lower to:upper]];
+        }
+    }
+    if (![ranges count]) {
+        [ranges addObject:[self nonInlinedDatatypeIdentifierRange]];
+    }
+    // inlined decimals and floats don't sort in value order, so all of them are included
+    unsigned char decimal   = (NODE_TYPE_DATATYPE << 4) | NODE_SUBTYPE_DECIMAL;
+    unsigned char flt       = (NODE_TYPE_DATATYPE << 4) | NODE_SUBTYPE_FLOAT;
+    [ranges addObject:node_id_range(decimal, decimal)];
+    [ranges addObject:node_id_range(flt, flt)];
+    return ranges;
+}
+
+#pragma mark -
+
 - (BOOL) identifierHasInlinedTerm:(NSData*)ident {
     uint64_t idvalue  = 0;
     [ident getBytes:&idvalue length:8];
@@ -75,21 +75,47 @@ id<GTWTerm> termFromData(SPKTurtleParser* p, NSData* data) {
     return term;
 }
 
+static BOOL term_is_numeric_in_range ( id<GTWTerm> term, double min, double max ) {
+    static NSSet* numericTypes  = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSMutableSet* set   = [NSMutableSet set];
+        for (NSString* local in @[@"integer", @"decimal", @"float", @"double", @"nonPositiveInteger", @"negativeInteger", @"long", @"int", @"short", @"byte", @"nonNegativeInteger", @"unsignedLong", @"unsignedInt", @"unsignedShort", @"unsignedByte", @"positiveInteger"]) {
+            [set addObject:[@"http://www.w3.org/2001/XMLSchema#" stringByAppendingString:local]];
+        }
+        numericTypes    = set;
+    });
+    if (term.termType != GTWTermLiteral)
+        return NO;
+    if (![numericTypes containsObject:term.datatype])
+        return NO;
+    double value    = [term.value doubleValue];
+    return (value >= min && value <= max);
+}
+
 void usage ( int argc, const char* argv[]) {
     const char* cmd = argv[0];
     fprintf(stdout, "Usage:\n");
     fprintf(stdout, "    %s [OPTIONS] import FILE.ttl\n", cmd);
     fprintf(stdout, "    %s [OPTIONS] delete FILE.ttl\n", cmd);
     fprintf(stdout, "    %s [OPTIONS] export [S] [P] [O] [G]\n", cmd);
+    fprintf(stdout, "    %s [OPTIONS] diff GENERATION\n", cmd);
     fprintf(stdout, "\n");
     fprintf(stdout, "Options:\n");
     fprintf(stdout, "    -v     Produce verbose output.\n");
     fprintf(stdout, "    -B     Causes the export operation to work on the previous quad-store version state.\n");
     fprintf(stdout, "           This option may be used more than once to export arbitrary quad-store versions.\n");
+    fprintf(stdout, "    -t TIMESTAMP\n");
+    fprintf(stdout, "           Causes the export and diff operations to work on the quad-store version state\n");
+    fprintf(stdout, "           as of the given time (in seconds since the epoch).\n");
     fprintf(stdout, "    -b BASE_URI\n");
     fprintf(stdout, "           Sets the base URI used during an import.\n");
     fprintf(stdout, "    -g GRAPH_URI\n");
     fprintf(stdout, "           Sets the graph URI used during an import.\n");
+    fprintf(stdout, "    -T TYPE\n");
+    fprintf(stdout, "           Restricts the export to quads whose object is of the given type (iri, blank or literal).\n");
+    fprintf(stdout, "    -n MIN MAX\n");
+    fprintf(stdout, "           Restricts the export to quads whose object is a numeric literal in the range [MIN, MAX].\n");
     fprintf(stdout, "\n");
 }
 
@@ -103,10 +129,15 @@ int main(int argc, const char * argv[]) {
     
     BOOL verbose            = NO;
     NSInteger back          = 0;
+    NSDate* asOf            = nil;
     NSInteger pageID        = -1;
     const char* filename    = "test.db";
     const char* basestr     = "http://base.example.org/";
     const char* graphstr    = NULL;
+    GTWTermType objectType  = GTWTermVariable;
+    BOOL numericFilter      = NO;
+    double numericMin       = 0.0;
+    double numericMax       = 0.0;
     
     while (argc > argi && argv[argi][0] == '-') {
         if (!strcmp(argv[argi], "-s")) {
@@ -124,6 +155,27 @@ int main(int argc, const char * argv[]) {
         } else if (!strcmp(argv[argi], "-B")) {
             argi++;
             back++;
+        } else if (!strcmp(argv[argi], "-t")) {
+            argi++;
+            asOf    = [NSDate dateWithTimeIntervalSince1970:atof(argv[argi++])];
+        } else if (!strcmp(argv[argi], "-T")) {
+            argi++;
+            const char* type    = argv[argi++];
+            if (!strcmp(type, "iri")) {
+                objectType  = GTWTermIRI;
+            } else if (!strcmp(type, "blank")) {
+                objectType  = GTWTermBlank;
+            } else if (!strcmp(type, "literal")) {
+                objectType  = GTWTermLiteral;
+            } else {
+                usage(argc, argv);
+                return 1;
+            }
+        } else if (!strcmp(argv[argi], "-n")) {
+            argi++;
+            numericFilter   = YES;
+            numericMin      = atof(argv[argi++]);
+            numericMax      = atof(argv[argi++]);
         } else if (!strcmp(argv[argi], "-v")) {
             argi++;
             verbose = YES;
@@ -143,31 +195,35 @@ int main(int argc, const char * argv[]) {
     srand([[NSDate date] timeIntervalSince1970]);
     const char* op  = argv[argi++];
     NSString* ops   = [NSString stringWithFormat:@"%s", op];
-    if ([ops rangeOfString:@"(export)" options:NSRegularExpressionSearch].location == 0) {
+    if ([ops rangeOfString:@"(export|diff)" options:NSRegularExpressionSearch].location == 0) {
         // read-only AOF branch
         id<GTWAOF> aof   = [[GTWAOFMemoryMappedFile alloc] initWithFilename:@(filename)];
-        if (!strcmp(op, "export")) {
-            //        NSLog(@"Exporting from QuadStore #%lld", (long long)pageID);
-            GTWAOFQuadStore* store  = (pageID < 0) ? [[GTWAOFQuadStore alloc] initWithAOF:aof] : [[GTWAOFQuadStore alloc] initWithPageID:pageID fromAOF:aof];
-//            NSLog(@"Current version: %lld", (long long)store.pageID);
-            if (back) {
-                while (back > 0) {
-                    if (verbose) {
-                        NSLog(@"Going back to a previous version");
-                    }
-                    back--;
-                    store   = [store previousState];
-                    if (!store) {
-                        NSLog(@"Attempt to export from state of QuadStore prior to its creation");
-                        return 1;
-                    }
-//                    NSLog(@"Current version: %lld", (long long)store.pageID);
-                }
+        //        NSLog(@"Exporting from QuadStore #%lld", (long long)pageID);
+        GTWAOFQuadStore* store  = (pageID < 0) ? [[GTWAOFQuadStore alloc] initWithAOF:aof] : [[GTWAOFQuadStore alloc] initWithPageID:pageID fromAOF:aof];
+        if (!store) {
+            NSLog(@"Failed to create quad store object");
+            return 1;
+        }
+//        NSLog(@"Current version: %lld", (long long)store.pageID);
+        if (asOf) {
+            store   = [store stateAsOfDate:asOf];
+            if (!store) {
+                NSLog(@"Attempt to use the state of QuadStore prior to its creation");
+                return 1;
             }
+        }
+        if (back) {
+            if (verbose) {
+                NSLog(@"Going back %lld versions", (long long)back);
+            }
+            store   = [store stateWithGeneration:[store generation] - back];
             if (!store) {
-                NSLog(@"Failed to create quad store object");
+                NSLog(@"Attempt to use the state of QuadStore prior to its creation");
                 return 1;
             }
+//            NSLog(@"Current version: %lld", (long long)store.pageID);
+        }
+        if (!strcmp(op, "export")) {
             SPKTurtleParser* parser  = [[SPKTurtleParser alloc] init];
             id<GTWTerm> s, p, o, g;
             if (argc > argi) {
@@ -201,12 +257,43 @@ int main(int argc, const char * argv[]) {
                 NSDate* date    = [store lastModifiedDateForQuadsMatchingSubject:s predicate:p object:o graph:g error:&error];
                 fprintf(stderr, "# Last-Modified: %s\n\n", [[date descriptionWithCalendarFormat:@"%Y-%m-%dT%H:%M:%S%z" timeZone:[NSTimeZone localTimeZone] locale:[NSLocale currentLocale]] UTF8String]);
             }
-            [store enumerateQuadsMatchingSubject:s predicate:p object:o graph:g usingBlock:^(id<GTWQuad> q) {
+            // push the object filters down to the store as term ID ranges. the ranges may match more terms than the
+            // filters do, so each filter is still checked on the enumerated quads.
+            NSDictionary* ranges    = nil;
+            if (numericFilter) {
+                ranges  = @{ @"O": [store.gen identifierRangesForNumericValuesFrom:numericMin to:numericMax] };
+            } else if (objectType != GTWTermVariable) {
+                ranges  = @{ @"O": [store.gen identifierRangesForTermType:objectType] };
+            }
+            [store enumerateQuadsMatchingSubject:s predicate:p object:o graph:g identifierRanges:ranges usingBlock:^(id<GTWQuad> q) {
+                if (objectType != GTWTermVariable && q.object.termType != objectType)
+                    return;
+                if (numericFilter && !term_is_numeric_in_range(q.object, numericMin, numericMax))
+                    return;
                 fprintf(stdout, "%s\n", [[q description] UTF8String]);
             } error:&error];
             if (verbose) {
                 fprintf(stderr, "export time: %lf\n", elapsed_time(start_export));
             }
+        } else if (!strcmp(op, "diff")) {
+            if (argc <= argi) {
+                usage(argc, argv);
+                return 1;
+            }
+            NSInteger generation    = atoll(argv[argi++]);
+            GTWAOFQuadStore* from   = [store stateWithGeneration:generation];
+            if (!from) {
+                NSLog(@"No QuadStore version with generation %lld", (long long)generation);
+                return 1;
+            }
+            NSError* error;
+            double start_diff = current_time();
+            [store enumerateDifferencesFromState:from usingBlock:^(id<GTWQuad> q, BOOL added) {
+                fprintf(stdout, "%c %s\n", (added ? '+' : '-'), [[q description] UTF8String]);
+            } error:&error];
+            if (verbose) {
+                fprintf(stderr, "diff time: %lf\n", elapsed_time(start_diff));
+            }
         } else {
             NSLog(@"Unrecognized operation '%s'", op);
             return 1;
@@ -268,7 +355,7 @@ int main(int argc, const char * argv[]) {
             GTWIRI* graph       = [[GTWIRI alloc] initWithValue:defaultGraph];
             SPKTurtleParser* p  = [[SPKTurtleParser alloc] initWithLexer:l base: baseuri];
             if (p) {
-    //            [store beginBulkLoad];
+                [store beginBulkLoad];
                 __block NSUInteger count    = 0;
                 [p enumerateTriplesWithBlock:^(id<GTWTriple> t) {
                     GTWQuad* q  = [GTWQuad quadFromTriple:t withGraph:graph];
@@ -283,7 +370,7 @@ int main(int argc, const char * argv[]) {
                 if (verbose) {
                     fprintf(stderr, "\n");
                 }
-    //            [store endBulkLoad];
+                [store endBulkLoad];
             } else {
                 NSLog(@"Could not construct parser");
             }